@@ -0,0 +1,49 @@
+mingw32-gcc -O2 -o bench/event_bench.exe ^
+	bench/event_bench.c ^
+	util/log/log.c ^
+	util/log/logbinary.c ^
+	util/log/logfile.c ^
+	util/misc/mapfile.c ^
+	util/misc/mpmc.c ^
+	util/misc/thread.c ^
+	util/misc/timeutils.c ^
+	util/misc/histogram.c ^
+	event/event.c ^
+	event/timer.c
+
+mingw32-gcc -O2 -o bench/spsc_bench.exe ^
+	bench/spsc_bench.c ^
+	util/log/log.c ^
+	util/log/logbinary.c ^
+	util/log/logfile.c ^
+	util/misc/mapfile.c ^
+	util/misc/mpmc.c ^
+	util/misc/queue.c ^
+	util/misc/spsc.c ^
+	util/misc/thread.c ^
+	util/misc/timeutils.c
+
+mingw32-gcc -O2 -o bench/log_bench.exe ^
+	bench/log_bench.c ^
+	util/log/log.c ^
+	util/log/logbinary.c ^
+	util/log/logfile.c ^
+	util/misc/mapfile.c ^
+	util/misc/mpmc.c ^
+	util/misc/thread.c ^
+	util/misc/timeutils.c
+
+mingw32-gcc -O2 -o bench/config_bench.exe ^
+	bench/config_bench.c ^
+	util/config/config.c ^
+	util/misc/arena.c ^
+	util/misc/epoch.c ^
+	util/misc/filewatch.c ^
+	util/misc/stringutils.c ^
+	util/log/log.c ^
+	util/log/logbinary.c ^
+	util/log/logfile.c ^
+	util/misc/mapfile.c ^
+	util/misc/mpmc.c ^
+	util/misc/thread.c ^
+	util/misc/timeutils.c
@@ -0,0 +1,207 @@
+/*
+ * Config loading benchmark.
+ *
+ * Writes config files of increasing size and times config_load() against the
+ * fgets()/sscanf() loader it replaced, which is kept below as legacy_load().
+ * Both build the same pairs through the config API. The time taken by
+ * config_close() and the memory held by the loaded config are reported
+ * alongside. Each case prints one JSON object per line.
+ *
+ * Usage: config_bench [scratch file]
+ *
+ * Built by bench.bat, or on Linux from the src directory with:
+ *	gcc -O2 -o bench/config_bench bench/config_bench.c util/config/config.c \
+ *		util/misc/arena.c util/misc/epoch.c util/misc/filewatch.c \
+ *		util/misc/stringutils.c util/log/log.c \
+ *		util/log/logbinary.c util/log/logfile.c util/misc/mapfile.c \
+ *		util/misc/mpmc.c util/misc/thread.c util/misc/timeutils.c -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../util/config/config.h"
+#include "../util/log/log.h"
+#include "../util/misc/stringutils.h"
+#include "../util/misc/timeutils.h"
+
+#define DEFAULT_FILE		"config_bench.conf"
+#define RUNS				5
+
+static const unsigned int pair_counts[] = { 10000, 100000, 500000 };
+
+#define COUNT_OF(a)			(sizeof(a) / sizeof((a)[0]))
+
+/*
+ * The line by line loader used before config_load() mapped the file. Lines
+ * are read into a 255 byte buffer and tokens into 50 byte arrays, so the
+ * generated keys and values are kept well short of those limits.
+ */
+static
+int
+legacy_load(char *filename) {
+	FILE *fp;
+	int handle;
+	unsigned int line;
+	char str[255];
+	char key[50], value[50];
+	int result = CONFIG_SUCCESS;
+
+	handle = config_create();
+	if (handle < 0) {
+		return handle;
+	}
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		config_close(handle);
+		return CONFIG_NOT_FOUND;
+	}
+
+	line = 1;
+	while (!feof(fp)) {
+		str[0] = '\0';
+		if (fgets(str, sizeof(str), fp) == NULL) {
+			break;
+		}
+		if (strlen(trim_whitespace(str)) > 0) {
+			if (sscanf(str, "%s %s", key, value) != 2 ||
+					config_set(handle, key, value) != CONFIG_SUCCESS) {
+				result = CONFIG_INVALID;
+				break;
+			}
+		}
+
+		line++;
+	}
+
+	fclose(fp);
+
+	if (result != CONFIG_SUCCESS) {
+		config_close(handle);
+		return result;
+	}
+
+	return handle;
+}
+
+/*
+ * Writes a config file holding the specified number of pairs.
+ * Returns the size of the file in bytes, or 0 if it could not be written.
+ */
+static
+unsigned long long
+write_config(const char *filename, unsigned int pairs) {
+	FILE *fp;
+	unsigned long long size = 0;
+	unsigned int i;
+	int written;
+
+	fp = fopen(filename, "w");
+	if (fp == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < pairs; i++) {
+		written = fprintf(fp, "service%u.setting.option_%u\tvalue-%08x\n",
+			i % 64, i, i * 2654435761u);
+		if (written < 0) {
+			fclose(fp);
+			return 0;
+		}
+		size += written;
+	}
+
+	fclose(fp);
+	return size;
+}
+
+/*
+ * Loads and closes the file RUNS times with the specified loader and prints
+ * the fastest of each. The loaded config is checked between the two.
+ */
+static
+void
+run_case(const char *name, int (*load)(char *), char *filename,
+			unsigned int pairs, unsigned long long size) {
+	unsigned long long start;
+	unsigned long long elapsed;
+	unsigned long long best = 0;
+	unsigned long long best_close = 0;
+	ConfigStats stats;
+	char key[64];
+	char *value;
+	unsigned int run;
+	int handle;
+
+	for (run = 0; run < RUNS; run++) {
+		start = time_now_ns();
+		handle = load(filename);
+		elapsed = time_now_ns() - start;
+
+		if (handle < 0) {
+			fprintf(stderr, "%s could not load %s (%d)\n", name, filename,
+				handle);
+			return;
+		}
+
+		// make sure both loaders built the same config
+		sprintf(key, "service%u.setting.option_%u", (pairs - 1) % 64,
+			pairs - 1);
+		value = config_get(handle, key);
+		if (value == NULL || strlen(value) != 14) {
+			fprintf(stderr, "%s loaded the wrong value for %s\n", name, key);
+		}
+		config_get_stats(handle, &stats);
+
+		if (best == 0 || elapsed < best) {
+			best = elapsed;
+		}
+
+		start = time_now_ns();
+		config_close(handle);
+		elapsed = time_now_ns() - start;
+
+		if (best_close == 0 || elapsed < best_close) {
+			best_close = elapsed;
+		}
+	}
+
+	printf("{\"loader\":\"%s\",\"pairs\":%u,\"file_bytes\":%llu,"
+		"\"load_ms\":%.3f,\"ns_per_pair\":%.1f,\"mb_per_sec\":%.1f,"
+		"\"close_ms\":%.3f,\"arena_blocks\":%u,\"arena_bytes\":%llu,"
+		"\"index_bytes\":%llu}\n",
+		name, pairs, size, best / 1e6, (double)best / pairs,
+		(size / 1048576.0) / (best / 1e9), best_close / 1e6,
+		stats.arena_blocks, stats.arena_reserved, stats.index_bytes);
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+	char *filename = DEFAULT_FILE;
+	unsigned long long size;
+	unsigned int i;
+
+	if (argc > 1) {
+		filename = argv[1];
+	}
+
+	// keep the benchmark free of log output
+	log_init(LOG_TO_STDOUT, NULL, LOG_LEVEL_SEVERE);
+
+	for (i = 0; i < COUNT_OF(pair_counts); i++) {
+		size = write_config(filename, pair_counts[i]);
+		if (size == 0) {
+			fprintf(stderr, "Could not write %s\n", filename);
+			break;
+		}
+
+		run_case("legacy_fgets", legacy_load, filename, pair_counts[i], size);
+		run_case("mapped", config_load, filename, pair_counts[i], size);
+	}
+
+	remove(filename);
+	log_close();
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Event bus microbenchmark.
+ *
+ * Drives event_init(), event_subscribe(), event_trigger() and event_process()
+ * across a matrix of subscriber counts, event ID cardinalities, payload sizes
+ * and burst sizes. Each scenario prints one JSON object per line so runs of
+ * different builds can be compared with standard tools.
+ *
+ * Usage: event_bench [events per scenario] [workers]
+ *
+ * Built by bench.bat, or on Linux from the src directory with:
+ *	gcc -O2 -o bench/event_bench bench/event_bench.c event/event.c \
+ *		event/timer.c util/log/log.c util/log/logbinary.c \
+ *		util/log/logfile.c util/misc/mapfile.c util/misc/mpmc.c \
+ *		util/misc/thread.c util/misc/timeutils.c util/misc/histogram.c \
+ *		-lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../event/event.h"
+#include "../util/log/log.h"
+#include "../util/misc/histogram.h"
+#include "../util/misc/timeutils.h"
+
+#define DEFAULT_EVENTS		100000
+
+static const unsigned int subscriber_counts[] = { 1, 4, 16 };
+static const unsigned int id_counts[] = { 1, 64, 1024 };
+static const unsigned int payload_sizes[] = { 8, 64, 1024 };
+static const unsigned int burst_sizes[] = { 1, 64, 1024 };
+
+#define COUNT_OF(a)			(sizeof(a) / sizeof((a)[0]))
+
+/*
+ * Every payload starts with the time it was triggered at.
+ */
+static Histogram latency;
+static unsigned long long checksum;
+
+/*
+ * The first subscriber of every event ID measures trigger to dispatch time.
+ */
+static
+void
+first_subscriber(unsigned int size, char *data) {
+	unsigned long long triggered;
+
+	memcpy(&triggered, data, sizeof(triggered));
+	histogram_record(&latency, time_now_ns() - triggered);
+	__atomic_fetch_add(&checksum, (unsigned char)data[size - 1],
+		__ATOMIC_RELAXED);
+}
+
+/*
+ * Remaining subscribers touch both ends of the payload.
+ */
+static
+void
+other_subscriber(unsigned int size, char *data) {
+	__atomic_fetch_add(&checksum, (unsigned char)data[0] +
+		(unsigned char)data[size - 1], __ATOMIC_RELAXED);
+}
+
+/*
+ * Runs a single scenario and prints its results.
+ */
+static
+void
+run_scenario(unsigned int events, unsigned int workers,
+				unsigned int subscribers, unsigned int ids,
+				unsigned int payload_size, unsigned int burst) {
+	EventStats before;
+	EventStats after;
+	char *payloads;
+	char *payload;
+	unsigned long long start;
+	unsigned long long elapsed;
+	unsigned long long now;
+	unsigned int triggered = 0;
+	unsigned int i;
+	unsigned int j;
+
+	// one payload per event in a burst so none is reused before dispatch
+	payloads = malloc((size_t)payload_size * burst);
+	if (payloads == NULL) {
+		fprintf(stderr, "Insufficient memory for payloads\n");
+		return;
+	}
+	memset(payloads, 0x5a, (size_t)payload_size * burst);
+
+	event_init(burst, workers);
+	event_set_overflow_policy(EVENT_OVERFLOW_GROW);
+	for (i = 0; i < ids; i++) {
+		event_subscribe(i, first_subscriber);
+		for (j = 1; j < subscribers; j++) {
+			event_subscribe(i, other_subscriber);
+		}
+	}
+
+	histogram_reset(&latency);
+	event_get_stats(&before);
+
+	start = time_now_ns();
+	while (triggered < events) {
+		for (i = 0; i < burst && triggered < events; i++, triggered++) {
+			payload = payloads + (size_t)payload_size * i;
+			now = time_now_ns();
+			memcpy(payload, &now, sizeof(now));
+			event_trigger(triggered % ids, payload_size, payload);
+		}
+		event_process();
+	}
+	elapsed = time_now_ns() - start;
+
+	// the bus allocates when the event pool takes a new slab, a lane has to
+	// grow or, with workers, the batch arrays have to grow
+	event_get_stats(&after);
+	event_close();
+	free(payloads);
+
+	printf("{\"workers\":%u,\"subscribers\":%u,\"event_ids\":%u,"
+		"\"payload_bytes\":%u,\"burst\":%u,\"events\":%u,"
+		"\"events_per_sec\":%.0f,\"dispatch_p50_ns\":%llu,"
+		"\"dispatch_p99_ns\":%llu,\"dispatch_p999_ns\":%llu,"
+		"\"allocs_per_event\":%.6f}\n",
+		workers, subscribers, ids, payload_size, burst, events,
+		events / (elapsed / 1e9),
+		histogram_percentile(&latency, 0.5),
+		histogram_percentile(&latency, 0.99),
+		histogram_percentile(&latency, 0.999),
+		(double)(after.pool_slabs - before.pool_slabs + after.grown -
+			before.grown + after.batch_allocs - before.batch_allocs) /
+			events);
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+	unsigned int events = DEFAULT_EVENTS;
+	unsigned int workers = 0;
+	unsigned int s;
+	unsigned int d;
+	unsigned int p;
+	unsigned int b;
+
+	if (argc > 1) {
+		events = (unsigned int)strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		workers = (unsigned int)strtoul(argv[2], NULL, 10);
+	}
+
+	// keep the benchmark free of log output
+	log_init(LOG_TO_STDOUT, NULL, LOG_LEVEL_ERROR | LOG_LEVEL_SEVERE);
+
+	for (s = 0; s < COUNT_OF(subscriber_counts); s++) {
+		for (d = 0; d < COUNT_OF(id_counts); d++) {
+			for (p = 0; p < COUNT_OF(payload_sizes); p++) {
+				for (b = 0; b < COUNT_OF(burst_sizes); b++) {
+					run_scenario(events, workers, subscriber_counts[s],
+						id_counts[d], payload_sizes[p], burst_sizes[b]);
+				}
+			}
+		}
+	}
+
+	log_close();
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Logging overhead microbenchmark.
+ *
+ * Measures what a LOG_DEBUG statement costs when debug messages are not being
+ * written, next to an empty loop and a direct log_write() call. Each argument
+ * is produced by a function that counts how often it runs, so the results
+ * also show whether the arguments were evaluated. Each case prints one JSON
+ * object per line.
+ *
+ * In a release build (without DEBUG) LOG_DEBUG is compiled out and costs the
+ * same as the empty loop. Building with -DDEBUG measures the inline runtime
+ * check instead.
+ *
+ * Usage: log_bench [iterations]
+ *
+ * Built by bench.bat, or on Linux from the src directory with:
+ *	gcc -O2 -o bench/log_bench bench/log_bench.c util/log/log.c \
+ *		util/log/logbinary.c util/log/logfile.c util/misc/mapfile.c \
+ *		util/misc/mpmc.c util/misc/thread.c util/misc/timeutils.c -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../util/log/log.h"
+#include "../util/misc/timeutils.h"
+
+#define DEFAULT_ITERATIONS	100000000
+
+/*
+ * Stops the compiler from merging or removing the loop bodies.
+ */
+#define BARRIER()			__asm__ __volatile__("" ::: "memory")
+
+static unsigned long long evaluations;
+
+/*
+ * Stands in for an argument that is costly to produce.
+ */
+static
+__attribute__((noinline))
+unsigned int
+expensive_argument(unsigned int i) {
+	evaluations++;
+	return i * 2654435761u;
+}
+
+/*
+ * Prints the result of one case.
+ */
+static
+void
+report(const char *name, unsigned int iterations, unsigned long long elapsed) {
+	printf("{\"case\":\"%s\",\"debug_compiled\":%s,\"iterations\":%u,"
+		"\"ns_per_call\":%.3f,\"arguments_evaluated\":%llu}\n",
+		name, (LOG_COMPILE_LEVELS & LOG_LEVEL_DEBUG) ? "true" : "false",
+		iterations, (double)elapsed / iterations, evaluations);
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+	unsigned int iterations = DEFAULT_ITERATIONS;
+	unsigned long long start;
+	unsigned int i;
+
+	if (argc > 1) {
+		iterations = (unsigned int)strtoul(argv[1], NULL, 10);
+	}
+
+	// debug messages are switched off at runtime in every case
+	log_init(LOG_TO_STDOUT, NULL, LOG_LEVEL_ERROR | LOG_LEVEL_SEVERE);
+
+	evaluations = 0;
+	start = time_now_ns();
+	for (i = 0; i < iterations; i++) {
+		BARRIER();
+	}
+	report("empty_loop", iterations, time_now_ns() - start);
+
+	evaluations = 0;
+	start = time_now_ns();
+	for (i = 0; i < iterations; i++) {
+		LOG_DEBUG("Event added. %u events on the queue.",
+			expensive_argument(i));
+		BARRIER();
+	}
+	report("log_debug_off", iterations, time_now_ns() - start);
+
+	// what every LOG_DEBUG used to cost
+	evaluations = 0;
+	start = time_now_ns();
+	for (i = 0; i < iterations; i++) {
+		log_write(LOG_LEVEL_DEBUG, "Event added. %u events on the queue.",
+			expensive_argument(i));
+		BARRIER();
+	}
+	report("log_write_off", iterations, time_now_ns() - start);
+
+	log_close();
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Single-producer/single-consumer queue benchmark.
+ *
+ * One thread pushes a fixed number of items while a second thread pops them,
+ * first through a linked Queue guarded by a mutex and then through the Spsc
+ * ring, one item at a time and in batches. Each run prints one JSON object
+ * per line.
+ *
+ * Usage: spsc_bench [items] [capacity] [batch]
+ *
+ * Built by bench.bat, or on Linux from the src directory with:
+ *	gcc -O2 -o bench/spsc_bench bench/spsc_bench.c util/misc/queue.c \
+ *		util/misc/spsc.c util/misc/thread.c util/misc/timeutils.c \
+ *		util/log/log.c util/log/logbinary.c util/log/logfile.c \
+ *		util/misc/mapfile.c util/misc/mpmc.c -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../util/log/log.h"
+#include "../util/misc/queue.h"
+#include "../util/misc/spsc.h"
+#include "../util/misc/thread.h"
+#include "../util/misc/timeutils.h"
+
+#define DEFAULT_ITEMS		10000000
+#define DEFAULT_CAPACITY	1024
+#define DEFAULT_BATCH		64
+#define MAX_BATCH			1024
+
+/*
+ * Shared by both threads of a run. Items are the numbers 1 to items so the
+ * consumer can check it saw each of them once and in order.
+ */
+struct sBenchRun {
+	unsigned int items;
+	unsigned int capacity;
+	unsigned int batch;
+	Queue *queue;
+	Mutex lock;
+	Spsc *ring;
+	unsigned long long checksum;
+	unsigned int out_of_order;
+};
+
+typedef struct sBenchRun BenchRun;
+
+/*
+ * The linked queue has no capacity limit, so the producer backs off once it
+ * is capacity items ahead to keep the comparison fair.
+ */
+static
+void
+queue_producer(void *arg) {
+	BenchRun *run = arg;
+	unsigned int i = 1;
+	unsigned int size;
+
+	while (i <= run->items) {
+		mutex_lock(&run->lock);
+		size = queue_size(run->queue);
+		if (size < run->capacity) {
+			queue_push(run->queue, (void *)(size_t)i++);
+		}
+		mutex_unlock(&run->lock);
+
+		if (size >= run->capacity) {
+			thread_yield();
+		}
+	}
+}
+
+static
+void
+queue_consumer(void *arg) {
+	BenchRun *run = arg;
+	unsigned int expected = 1;
+	unsigned int item;
+
+	while (expected <= run->items) {
+		mutex_lock(&run->lock);
+		item = (unsigned int)(size_t)queue_pop(run->queue);
+		mutex_unlock(&run->lock);
+
+		if (item == 0) {
+			thread_yield();
+			continue;
+		}
+
+		run->out_of_order += item != expected++;
+		run->checksum += item;
+	}
+}
+
+static
+void
+spsc_producer(void *arg) {
+	BenchRun *run = arg;
+	unsigned int i = 1;
+
+	while (i <= run->items) {
+		if (spsc_push(run->ring, (void *)(size_t)i)) {
+			i++;
+		} else {
+			thread_yield();
+		}
+	}
+}
+
+static
+void
+spsc_consumer(void *arg) {
+	BenchRun *run = arg;
+	unsigned int expected = 1;
+	void *item;
+
+	while (expected <= run->items) {
+		if (!spsc_pop(run->ring, &item)) {
+			thread_yield();
+			continue;
+		}
+
+		run->out_of_order += (unsigned int)(size_t)item != expected++;
+		run->checksum += (size_t)item;
+	}
+}
+
+static
+void
+spsc_batch_producer(void *arg) {
+	BenchRun *run = arg;
+	void *items[MAX_BATCH];
+	unsigned int first = 0;		// first item of the batch not yet in the ring
+	unsigned int count = 0;
+	unsigned int added;
+	unsigned int i = 1;
+
+	while (i <= run->items || first < count) {
+		// refill the local batch once the ring has taken all of it
+		if (first == count) {
+			first = 0;
+			count = 0;
+			while (count < run->batch && i <= run->items) {
+				items[count++] = (void *)(size_t)i++;
+			}
+		}
+
+		added = spsc_push_batch(run->ring, items + first, count - first);
+		if (added == 0) {
+			thread_yield();
+			continue;
+		}
+		first += added;
+	}
+}
+
+static
+void
+spsc_batch_consumer(void *arg) {
+	BenchRun *run = arg;
+	void *items[MAX_BATCH];
+	unsigned int expected = 1;
+	unsigned int count;
+	unsigned int j;
+
+	while (expected <= run->items) {
+		count = spsc_pop_batch(run->ring, items, run->batch);
+		if (count == 0) {
+			thread_yield();
+			continue;
+		}
+
+		for (j = 0; j < count; j++) {
+			run->out_of_order += (unsigned int)(size_t)items[j] != expected++;
+			run->checksum += (size_t)items[j];
+		}
+	}
+}
+
+/*
+ * Runs one producer/consumer pair and prints its throughput.
+ */
+static
+void
+run_pair(const char *name, BenchRun *run, ptrThreadMain producer,
+			ptrThreadMain consumer) {
+	Thread threads[2];
+	unsigned long long expected;
+	unsigned long long start;
+	unsigned long long elapsed;
+
+	run->checksum = 0;
+	run->out_of_order = 0;
+
+	start = time_now_ns();
+	if (!thread_create(&threads[1], consumer, run)) {
+		return;
+	}
+	if (!thread_create(&threads[0], producer, run)) {
+		thread_join(&threads[1]);
+		return;
+	}
+	thread_join(&threads[0]);
+	thread_join(&threads[1]);
+	elapsed = time_now_ns() - start;
+
+	expected = (unsigned long long)run->items * (run->items + 1) / 2;
+
+	printf("{\"queue\":\"%s\",\"items\":%u,\"capacity\":%u,\"batch\":%u,"
+		"\"items_per_sec\":%.0f,\"ns_per_item\":%.2f,\"valid\":%s}\n",
+		name, run->items, run->capacity, run->batch,
+		run->items / (elapsed / 1e9), (double)elapsed / run->items,
+		run->checksum == expected && run->out_of_order == 0 ?
+			"true" : "false");
+	fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+	BenchRun run;
+
+	run.items = DEFAULT_ITEMS;
+	run.capacity = DEFAULT_CAPACITY;
+	run.batch = DEFAULT_BATCH;
+
+	if (argc > 1) {
+		run.items = (unsigned int)strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		run.capacity = (unsigned int)strtoul(argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		run.batch = (unsigned int)strtoul(argv[3], NULL, 10);
+	}
+	if (run.batch == 0 || run.batch > MAX_BATCH) {
+		run.batch = DEFAULT_BATCH;
+	}
+
+	// keep the benchmark free of log output
+	log_init(LOG_TO_STDOUT, NULL, LOG_LEVEL_ERROR | LOG_LEVEL_SEVERE);
+
+	run.queue = queue_create();
+	run.ring = spsc_create(run.capacity);
+	if (run.queue == NULL || run.ring == NULL) {
+		fprintf(stderr, "Insufficient memory for queues\n");
+		return 1;
+	}
+	mutex_init(&run.lock);
+
+	run_pair("linked_mutex", &run, queue_producer, queue_consumer);
+	run_pair("spsc", &run, spsc_producer, spsc_consumer);
+	run_pair("spsc_batch", &run, spsc_batch_producer, spsc_batch_consumer);
+
+	mutex_destroy(&run.lock);
+	spsc_free(run.ring);
+	queue_free(run.queue);
+
+	log_close();
+	return 0;
+}
@@ -3,238 +3,1493 @@
 #include <string.h>
 
 #include "event.h"
+#include "timer.h"
 #include "../util/log/log.h"
+#include "../util/misc/thread.h"
+#include "../util/misc/timeutils.h"
+#ifdef EVENT_INSTRUMENT
+#include "../util/misc/histogram.h"
+#endif
 
-#define MAX_SUBSCRIBERS 	1024
+#define SUBSCRIBER_BITS		10		// log2 of MAX_SUBSCRIBERS
+#define MAX_SUBSCRIBERS 	(1u << SUBSCRIBER_BITS)
 #define MAX_EVENTS 			1024
+#define MAX_WORKERS			64
+#define WORKER_BATCH		64		// events per worker per timed batch
+#define EVENT_SLAB_SIZE		256		// events allocated at a time by the pool
+#define DENSE_EVENT_IDS		256		// event IDs below this are directly indexed
+
+/*
+ * Holds every subscriber of a single event ID in one contiguous array so
+ * that dispatching an event is a lookup followed by a walk of the array.
+ */
+struct sDispatch {
+	unsigned int event_id;
+	unsigned int used;
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int ordered;		// subscribers with EVENT_MODE_ORDERED
+	Subscriber *subscribers;
+	Event *strand_tail;			// last event added to this ID's strand
+	unsigned char coalesce;		// EVENT_COALESCE_x
+	ptrEventReduce reduce;
+	Event *pending;				// queued event later triggers collapse into
+	unsigned int coalesced;
+#ifdef EVENT_INSTRUMENT
+	unsigned long long triggered;
+	unsigned long long dispatched;
+	Histogram *latency;			// time from trigger to dispatch
+#endif
+};
+
+typedef struct sDispatch Dispatch;
+
+/*
+ * A unit of work handed to a worker. A concurrent task calls the concurrent
+ * subscribers for one event. An ordered task (a strand) calls the ordered
+ * subscribers for a chain of events with the same ID, one after the other.
+ */
+struct sTask {
+	Event *event;
+	Dispatch *dispatch;
+	unsigned char mode;
+};
+
+typedef struct sTask Task;
+
+/*
+ * Each worker owns a deque of tasks. The owner takes tasks from the bottom
+ * while idle workers steal from the top.
+ */
+struct sWorker {
+	Thread thread;
+	Mutex lock;
+	Task *tasks;
+	unsigned int capacity;
+	unsigned int top;
+	unsigned int bottom;
+};
+
+typedef struct sWorker Worker;
+
+/*
+ * Events are carved out of slabs so that triggering an event does not need
+ * to go through malloc. Released events are kept on a free list.
+ */
+struct sEventSlab {
+	struct sEventSlab *next;
+	Event events[EVENT_SLAB_SIZE];
+};
+
+typedef struct sEventSlab EventSlab;
 
 static unsigned int last_subscriber_id = 0;
-static Queue *event_subscribers;
-static unsigned int num_events;
-static Queue *event_queue;
 
+/*
+ * Event IDs below DENSE_EVENT_IDS index straight into dense_dispatch. Larger
+ * IDs are found in sparse_dispatch, an open addressing hash table with
+ * MAX_SUBSCRIBERS slots.
+ */
+static Dispatch dense_dispatch[DENSE_EVENT_IDS];
+static Dispatch sparse_dispatch[MAX_SUBSCRIBERS];
+static unsigned int sparse_count;
+
+/*
+ * Each priority lane is a ring buffer of Event pointers. head and tail are
+ * free running counters which are masked to find their slot, so the number of
+ * events queued in a lane is always (tail - head).
+ */
+struct sEventLane {
+	Event **ring;
+	unsigned int capacity;
+	unsigned int mask;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int weight;		// events per turn under EVENT_DRAIN_WEIGHTED
+};
+
+typedef struct sEventLane EventLane;
+
+static EventLane lanes[EVENT_LANES];
+static unsigned int queued_events;
+static unsigned char overflow_policy;
+static unsigned char drain_policy;
+static unsigned long long starvation_ns;
+static unsigned int wrr_lane;		// lane currently being served
+static unsigned int wrr_credit;		// events left in the current lane's turn
+static EventStats event_stats;
+
+/*
+ * Event pool. While workers are running it is guarded by queue_lock, which is
+ * already held whenever events are pushed or popped.
+ */
+static EventSlab *event_slabs;
+static Event *free_events;
+
+/*
+ * Delayed and periodic events. The wheel ticks once per millisecond and is
+ * guarded by queue_lock while workers are running.
+ */
+static TimerWheel timer_wheel;
+
+#ifdef EVENT_INSTRUMENT
+static unsigned long long init_ns;
+#endif
+
+/*
+ * Worker pool. queue_lock guards the event lanes while workers are running as
+ * subscribers may trigger events from any thread. pool_lock, work_cond and
+ * done_cond hand batches to the workers and wait for them to finish.
+ */
+static Worker *workers;
+static unsigned int worker_count;
+static Mutex queue_lock;
+static Mutex pool_lock;
+static Cond work_cond;
+static Cond done_cond;
+static unsigned int batch_id;
+static unsigned int pending_tasks;
+static unsigned int workers_stopping;
+static Event **batch_events;
+static unsigned int batch_capacity;
+static Task *batch_tasks;
+
+/*
+ * Rounds size up to the next power of two.
+ */
+static
+unsigned int
+round_pow2(unsigned int size) {
+	unsigned int pow2 = 1;
+
+	while (pow2 < size) {
+		pow2 <<= 1;
+	}
+
+	return pow2;
+}
+
+static void start_workers(unsigned int count);
+static Dispatch *get_dispatch(unsigned int event_id, unsigned int create);
+
+void
+event_init(unsigned int queue_size, unsigned int workers) {
+	unsigned int i;
+
+	LOG_DEBUG("Initiliasing event handling...");
+	memset(dense_dispatch, '\0', sizeof(dense_dispatch));
+	memset(sparse_dispatch, '\0', sizeof(sparse_dispatch));
+	sparse_count = 0;
+
+	if (queue_size == 0) {
+		queue_size = MAX_EVENTS;
+	}
+
+	memset(lanes, '\0', sizeof(lanes));
+	queued_events = 0;
+	overflow_policy = EVENT_OVERFLOW_DROP_NEWEST;
+	drain_policy = EVENT_DRAIN_STRICT;
+	starvation_ns = EVENT_STARVATION_NS;
+	memset(&event_stats, '\0', sizeof(EventStats));
+	event_slabs = NULL;
+	free_events = NULL;
+
+	// every lane gets the full queue size
+	for (i = 0; i < EVENT_LANES; i++) {
+		lanes[i].weight = 1 << (EVENT_LANES - 1 - i);
+		lanes[i].capacity = round_pow2(queue_size);
+		lanes[i].mask = lanes[i].capacity - 1;
+		lanes[i].ring = malloc(sizeof(Event *) * lanes[i].capacity);
+		if (lanes[i].ring == NULL) {
+			LOG_SEVERE("Could not allocate event queue. Insufficient memory.");
+			lanes[i].capacity = 0;
+			lanes[i].mask = 0;
+		}
+	}
+	wrr_lane = 0;
+	wrr_credit = lanes[0].weight;
+
+	timer_wheel_init(&timer_wheel, time_now_ns() / 1000000ULL);
+
+#ifdef EVENT_INSTRUMENT
+	init_ns = time_now_ns();
+#endif
+
+	start_workers(workers);
+}
+
+/*
+ * The event queue only needs locking once workers are able to trigger events.
+ */
+static
+void
+lock_queue() {
+	if (worker_count > 0) {
+		mutex_lock(&queue_lock);
+	}
+}
+
+static
+void
+unlock_queue() {
+	if (worker_count > 0) {
+		mutex_unlock(&queue_lock);
+	}
+}
+
+/*
+ * Takes an event from the pool, allocating a new slab when the free list is
+ * empty.
+ * Note: Call with the queue locked.
+ */
+static
+Event *
+acquire_event() {
+	EventSlab *slab;
+	Event *event;
+	unsigned int i;
+
+	if (free_events == NULL) {
+		slab = malloc(sizeof(EventSlab));
+		if (slab == NULL) {
+			return NULL;
+		}
+
+		// thread the new events onto the free list
+		for (i = 0; i < EVENT_SLAB_SIZE - 1; i++) {
+			slab->events[i].next = &slab->events[i + 1];
+		}
+		slab->events[EVENT_SLAB_SIZE - 1].next = NULL;
+		free_events = slab->events;
+
+		slab->next = event_slabs;
+		event_slabs = slab;
+		event_stats.pool_slabs++;
+	}
+
+	event = free_events;
+	free_events = event->next;
+	event->next = NULL;
+
+	event_stats.pool_acquired++;
+	if (++event_stats.pool_in_use > event_stats.pool_high_water) {
+		event_stats.pool_high_water = event_stats.pool_in_use;
+	}
+
+	return event;
+}
+
+/*
+ * Returns an event to the pool.
+ * Note: Call with the queue locked.
+ */
+static
+void
+release_event(Event *event) {
+	event->next = free_events;
+	free_events = event;
+	event_stats.pool_in_use--;
+}
+
+/*
+ * Frees every slab owned by the pool.
+ */
+static
+void
+free_event_slabs() {
+	EventSlab *slab;
+
+	while (event_slabs != NULL) {
+		slab = event_slabs;
+		event_slabs = slab->next;
+		free(slab);
+	}
+
+	free_events = NULL;
+}
+
+/*
+ * Returns the number of events currently sitting in the queue.
+ */
+static
+unsigned int
+peek_events() {
+	return queued_events;
+}
+
+/*
+ * Returns the number of events currently sitting in a single lane.
+ */
+static
+unsigned int
+lane_depth(EventLane *lane) {
+	return lane->tail - lane->head;
+}
+
+/*
+ * Doubles the number of slots in a lane. Queued events keep their order.
+ * Returns 1 if the lane was resized.
+ */
+static
+unsigned int
+grow_lane(EventLane *lane) {
+	Event **new_ring;
+	unsigned int new_capacity;
+	unsigned int count;
+	unsigned int i;
+
+	new_capacity = lane->capacity << 1;
+	if (new_capacity == 0) {
+		return 0;
+	}
+
+	new_ring = malloc(sizeof(Event *) * new_capacity);
+	if (new_ring == NULL) {
+		LOG_ERROR("Could not grow event queue. Insufficient memory.");
+		return 0;
+	}
+
+	// unwrap the queued events to the start of the new ring
+	count = lane_depth(lane);
+	for (i = 0; i < count; i++) {
+		new_ring[i] = lane->ring[(lane->head + i) & lane->mask];
+	}
+
+	free(lane->ring);
+	lane->ring = new_ring;
+	lane->capacity = new_capacity;
+	lane->mask = new_capacity - 1;
+	lane->head = 0;
+	lane->tail = count;
+	event_stats.grown++;
+
+	LOG_DEBUG("Event queue grown to %u slots", lane->capacity);
+	return 1;
+}
+
+/*
+ * Removes the first event from a lane without counting it as dispatched.
+ */
+static
+Event *
+take_lane(EventLane *lane) {
+	Event *event;
+
+	event = lane->ring[lane->head & lane->mask];
+	lane->head++;
+	queued_events--;
+
+	// once off the queue, new triggers of the ID must queue a fresh event
+	if (event->coalescing) {
+		get_dispatch(event->id, 0)->pending = NULL;
+		event->coalescing = 0;
+	}
+
+	return event;
+}
+
+/*
+ * Retrieves and removes the first event from a lane and records how long it
+ * waited.
+ */
+static
+Event *
+pop_lane(unsigned int priority, unsigned long long now) {
+	EventLaneStats *stats = &event_stats.lanes[priority];
+	Event *event;
+	unsigned long long wait_ns;
+
+	event = take_lane(&lanes[priority]);
+
+	wait_ns = now - event->queued_ns;
+	stats->dispatched++;
+	stats->total_wait_ns += wait_ns;
+	if (wait_ns > stats->max_wait_ns) {
+		stats->max_wait_ns = wait_ns;
+	}
+
+	return event;
+}
+
+/*
+ * Chooses the lane the next event is taken from.
+ * Returns EVENT_LANES if every lane is empty.
+ */
+static
+unsigned int
+next_lane(unsigned long long now) {
+	unsigned int top;
+	unsigned int i;
+
+	if (drain_policy == EVENT_DRAIN_WEIGHTED) {
+		// each lane gets up to its weight in events before moving on
+		for (i = 0; i <= EVENT_LANES; i++) {
+			if (wrr_credit > 0 && lane_depth(&lanes[wrr_lane]) > 0) {
+				wrr_credit--;
+				return wrr_lane;
+			}
+			wrr_lane = (wrr_lane + 1) % EVENT_LANES;
+			wrr_credit = lanes[wrr_lane].weight;
+		}
+		return EVENT_LANES;
+	}
+
+	for (top = 0; top < EVENT_LANES; top++) {
+		if (lane_depth(&lanes[top]) > 0) {
+			break;
+		}
+	}
+
+	// starvation guard: a lower lane whose oldest event has waited too long
+	// jumps ahead of the lanes above it
+	if (starvation_ns > 0) {
+		for (i = top + 1; i < EVENT_LANES; i++) {
+			if (lane_depth(&lanes[i]) > 0 && now -
+					lanes[i].ring[lanes[i].head & lanes[i].mask]->queued_ns >=
+					starvation_ns) {
+				event_stats.lanes[i].promoted++;
+				return i;
+			}
+		}
+	}
+
+	return top;
+}
+
+/*
+ * Retrieves and removes the next event from the queue according to the
+ * current drain policy.
+ */
+static
+Event *
+pop_event() {
+	unsigned long long now;
+	unsigned int priority;
+
+	if (peek_events() == 0) {
+		LOG_ERROR("Could not retrieve event. Event queue is empty.");
+		return NULL;
+	}
+
+	now = time_now_ns();
+	priority = next_lane(now);
+	if (priority == EVENT_LANES) {
+		return NULL;
+	}
+
+	return pop_lane(priority, now);
+}
+
+/*
+ * Places the specified event onto the back of its lane. If the lane is full
+ * the current overflow policy decides which event is lost.
+ * Note: Each lane operates on a FIFO basis.
+ * Returns 1 if the event was queued.
+ */
+static
+unsigned int
+push_event(Event *event, unsigned int priority) {
+	EventLane *lane = &lanes[priority];
+	EventLaneStats *stats = &event_stats.lanes[priority];
+
+	if (event == NULL) {
+		LOG_ERROR("Attempted to push a NULL event onto the queue. Ignoring...");
+		return 0;
+	}
+
+	event->queued_ns = time_now_ns();
+
+	if (lane_depth(lane) == lane->capacity) {
+		if (overflow_policy == EVENT_OVERFLOW_DROP_OLDEST &&
+				lane->capacity > 0) {
+			release_event(take_lane(lane));
+			event_stats.dropped_oldest++;
+		} else if (overflow_policy != EVENT_OVERFLOW_GROW ||
+				!grow_lane(lane)) {
+			event_stats.dropped_newest++;
+			return 0;
+		}
+	}
+
+	lane->ring[lane->tail & lane->mask] = event;
+	lane->tail++;
+	queued_events++;
+
+	stats->enqueued++;
+	if (lane_depth(lane) > stats->high_water) {
+		stats->high_water = lane_depth(lane);
+	}
+
+	LOG_DEBUG("Event added. %u events on the queue.", peek_events());
+	return 1;
+}
+
+/*
+ * Places a new event in the lane for the specified priority. If the event ID
+ * coalesces and one of its events is still queued, the trigger is folded into
+ * that event instead.
+ * Note: Call with the queue locked.
+ */
+static
+void
+queue_event(unsigned int event_id, unsigned char priority, unsigned int size,
+				void *data) {
+	Dispatch *dispatch;
+	Event *event;
+
+	dispatch = get_dispatch(event_id, 0);
+#ifdef EVENT_INSTRUMENT
+	if (dispatch != NULL) {
+		dispatch->triggered++;
+	}
+#endif
+
+	if (dispatch != NULL && dispatch->coalesce != EVENT_COALESCE_NONE &&
+			dispatch->pending != NULL) {
+		event = dispatch->pending;
+		if (dispatch->coalesce == EVENT_COALESCE_KEEP_LATEST) {
+			event->size = size;
+			event->data = data;
+		} else if (dispatch->coalesce == EVENT_COALESCE_MERGE) {
+			dispatch->reduce(event, size, data);
+		}
+
+		dispatch->coalesced++;
+		event_stats.coalesced++;
+		return;
+	}
+
+	// take an event from the pool and push it onto the back of the queue
+	event = acquire_event();
+	if (event == NULL) {
+		LOG_ERROR("Could not trigger event. Insufficient memory.");
+		return;
+	}
+
+	event->id = event_id;
+	event->size = size;
+	event->data = data;
+	event->coalescing = 0;
+
+	if (!push_event(event, priority)) {
+		LOG_WARN("Event queue is full. Event ID %u dropped.", event_id);
+		release_event(event);
+		return;
+	}
+
+	if (dispatch != NULL && dispatch->coalesce != EVENT_COALESCE_NONE) {
+		dispatch->pending = event;
+		event->coalescing = 1;
+	}
+}
+
+/*
+ * Called by the timer wheel for each timer that falls due. The timer's event
+ * joins the back of the normal lane.
+ * Note: Call with the queue locked.
+ */
+static
+void
+fire_timer(Timer *timer) {
+	queue_event(timer->event_id, EVENT_PRIORITY_NORMAL, timer->size,
+		timer->data);
+}
+
+/*
+ * Adds a timer for the specified event.
+ * Returns the timer's handle or 0 if it could not be added.
+ */
+static
+unsigned int
+add_timer(unsigned int event_id, unsigned int size, void *data,
+			unsigned int delay_ms, unsigned int interval_ms) {
+	Timer *timer;
+	unsigned int handle = 0;
+
+	lock_queue();
+	timer = timer_add(&timer_wheel, time_now_ns() / 1000000ULL + delay_ms,
+		interval_ms, &handle);
+	if (timer != NULL) {
+		timer->event_id = event_id;
+		timer->size = size;
+		timer->data = data;
+	}
+	unlock_queue();
+
+	return timer != NULL ? handle : 0;
+}
+
+/*
+ * Marks an unused dispatch entry as belonging to the specified event ID.
+ */
+static
+void
+claim_dispatch(Dispatch *dispatch, unsigned int event_id) {
+	dispatch->used = 1;
+	dispatch->event_id = event_id;
+
+#ifdef EVENT_INSTRUMENT
+	dispatch->latency = malloc(sizeof(Histogram));
+	if (dispatch->latency != NULL) {
+		histogram_reset(dispatch->latency);
+	}
+#endif
+}
+
+/*
+ * Retrieves the dispatch entry holding the subscribers for the specified
+ * event ID.
+ * create - when set, an empty entry is claimed if the event ID has none yet.
+ * Returns NULL if no entry exists (or none could be claimed).
+ */
+static
+Dispatch *
+get_dispatch(unsigned int event_id, unsigned int create) {
+	Dispatch *dispatch;
+	unsigned int slot;
+	unsigned int probes;
+
+	if (event_id < DENSE_EVENT_IDS) {
+		dispatch = &dense_dispatch[event_id];
+		if (!dispatch->used) {
+			if (!create) {
+				return NULL;
+			}
+			claim_dispatch(dispatch, event_id);
+		}
+		return dispatch;
+	}
+
+	// multiplicative hash, then linear probing until a match or a free slot.
+	// The top bits are taken as they depend on every bit of the ID.
+	slot = (event_id * 2654435761u) >> (32 - SUBSCRIBER_BITS);
+	for (probes = 0; probes < MAX_SUBSCRIBERS; probes++) {
+		dispatch = &sparse_dispatch[slot];
+		if (!dispatch->used) {
+			if (!create) {
+				return NULL;
+			}
+			if (sparse_count == MAX_SUBSCRIBERS - 1) {
+				// keep one free slot so failed lookups always terminate
+				LOG_ERROR("Could not index event ID %u. Dispatch table is " \
+					"full.", event_id);
+				return NULL;
+			}
+			claim_dispatch(dispatch, event_id);
+			sparse_count++;
+			return dispatch;
+		}
+		if (dispatch->event_id == event_id) {
+			return dispatch;
+		}
+		slot = (slot + 1) & (MAX_SUBSCRIBERS - 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * Releases the subscriber arrays held by the entries in the table.
+ */
+static
+void
+free_dispatch(Dispatch *table, unsigned int size) {
+	unsigned int i;
+
+	for (i = 0; i < size; i++) {
+#ifdef EVENT_INSTRUMENT
+		unsigned int j;
+
+		for (j = 0; j < table[i].count; j++) {
+			free(table[i].subscribers[j].duration);
+		}
+		free(table[i].latency);
+#endif
+		free(table[i].subscribers);
+	}
+
+	memset(table, '\0', sizeof(Dispatch) * size);
+}
+
+/*
+ * Calls a single subscriber of the dispatch entry, timing the call when
+ * instrumentation is compiled in.
+ * Note: The subscriber is looked up again after the call as the callback may
+ *		have grown the array by subscribing.
+ */
+static
+void
+call_subscriber(Dispatch *dispatch, unsigned int index, Event *event) {
+#ifdef EVENT_INSTRUMENT
+	unsigned long long start = time_now_ns();
+#endif
+
+	dispatch->subscribers[index].callback(event->size, (char *)event->data);
+
+#ifdef EVENT_INSTRUMENT
+	if (dispatch->subscribers[index].duration != NULL) {
+		histogram_record(dispatch->subscribers[index].duration,
+			time_now_ns() - start);
+	}
+#endif
+}
+
+#ifdef EVENT_INSTRUMENT
+/*
+ * Records that an event is about to be handed to its subscribers.
+ */
+static
 void
-event_init() {
-	LOG_DEBUG("Initiliasing event handling...");
-	num_events = 0;
-	event_subscribers = NULL;
-	event_queue = NULL;
+record_dispatch(Dispatch *dispatch, Event *event, unsigned long long now) {
+	__atomic_fetch_add(&dispatch->dispatched, 1, __ATOMIC_RELAXED);
+	if (dispatch->latency != NULL) {
+		histogram_record(dispatch->latency, now - event->queued_ns);
+	}
 }
+#endif
 
-/* 
- * Returns the number of events currently sitting in the queue.
+/*
+ * Calls every subscriber of the dispatch entry that uses the given mode.
  */
 static
-unsigned int
-peek_events() {
-	return num_events;
+void
+call_subscribers(Dispatch *dispatch, Event *event, unsigned char mode) {
+	unsigned int i;
+
+	for (i = 0; i < dispatch->count; i++) {
+		if (dispatch->subscribers[i].mode == mode) {
+			call_subscriber(dispatch, i, event);
+		}
+	}
 }
 
 /*
- * Places the specified event onto the event_queue
- * Note: The queue operates on a FIFO basis.
+ * Runs a single task. Ordered tasks walk their whole strand of events.
  */
 static
 void
-push_event(Event *event) {
-	Event *cur_event;
-	
-	if (event == NULL) {
-		LOG_ERROR("Attempted to push a NULL event onto the queue. Ignoring...");
+run_task(Task *task) {
+	Event *event;
+
+	if (task->mode == EVENT_MODE_CONCURRENT) {
+		call_subscribers(task->dispatch, task->event, EVENT_MODE_CONCURRENT);
+		return;
 	}
-	
-	LOG_DEBUG("Adding event to queue...");
-	
-	if (event_queue == NULL) {
-		// make this the first event in the queue
-		event_queue = event;
-	} else {
-		// add to the end of the queue
-		cur_event = event_queue;
-		while (cur_event->next != NULL) {
-			cur_event = cur_event->next;
+
+	for (event = task->event; event != NULL; event = event->next) {
+		call_subscribers(task->dispatch, event, EVENT_MODE_ORDERED);
+	}
+}
+
+/*
+ * Takes a task from a worker's deque. The owner takes from the bottom and
+ * thieves take from the top.
+ * Returns 1 if a task was taken.
+ */
+static
+unsigned int
+take_task(Worker *worker, unsigned int owner, Task *task) {
+	unsigned int taken = 0;
+
+	mutex_lock(&worker->lock);
+	if (worker->top < worker->bottom) {
+		if (owner) {
+			*task = worker->tasks[--worker->bottom];
+		} else {
+			*task = worker->tasks[worker->top++];
 		}
-		
-		cur_event->next = event;
+		taken = 1;
 	}
-	
-	num_events++;
-	
-	LOG_DEBUG("Event added. %d events on the queue.", peek_events());
+	mutex_unlock(&worker->lock);
+
+	return taken;
 }
 
 /*
- * Retrieves and removes the first event from the queue
+ * Runs tasks from the worker's own deque and then steals from the other
+ * workers until every deque is empty.
  */
 static
-Event *
-pop_event() {
-	Event *event;
-	Event *next_event;
-	
-	if (event_queue == NULL) {
-		LOG_ERROR("Could not retrieve event. Event queue is empty.");
-		return NULL;
+void
+run_tasks(unsigned int index) {
+	Task task;
+	unsigned int found;
+	unsigned int i;
+
+	do {
+		found = take_task(&workers[index], 1, &task);
+		for (i = 1; !found && i < worker_count; i++) {
+			found = take_task(&workers[(index + i) % worker_count], 0, &task);
+		}
+
+		if (found) {
+			run_task(&task);
+
+			// the last task of the batch wakes event_process()
+			if (__atomic_sub_fetch(&pending_tasks, 1, __ATOMIC_ACQ_REL) == 0) {
+				mutex_lock(&pool_lock);
+				cond_signal(&done_cond);
+				mutex_unlock(&pool_lock);
+			}
+		}
+	} while (found);
+}
+
+static
+void
+worker_main(void *arg) {
+	unsigned int index = (unsigned int)((Worker *)arg - workers);
+	unsigned int seen_batch = 0;
+
+	mutex_lock(&pool_lock);
+	while (!workers_stopping) {
+		if (batch_id == seen_batch) {
+			cond_wait(&work_cond, &pool_lock);
+			continue;
+		}
+		seen_batch = batch_id;
+
+		mutex_unlock(&pool_lock);
+		run_tasks(index);
+		mutex_lock(&pool_lock);
 	}
-	
-	event = event_queue;
-	next_event = event_queue->next;
-	event_queue = next_event;
-	num_events--;
-	
-	if (num_events < 0) {
-		LOG_ERROR("Event queue is reporting a negative number of events. " \
-			"Something is very wrong.");
-	}
-	
-	return event;
+	mutex_unlock(&pool_lock);
 }
 
 /*
- * Retrives a list of all subscribers for the specified event ID
+ * Creates the worker threads. Any worker that fails to start reduces the
+ * size of the pool.
  */
 static
-Subscriber *
-get_subscribers(unsigned int event_id) {
-	Subscriber *subscribers = NULL;
-	Subscriber *cur_event_sub;
-	Subscriber *last_dst_sub;
-	
-	if (event_subscribers == NULL) {
-		return NULL;
+void
+start_workers(unsigned int count) {
+	unsigned int i;
+
+	worker_count = 0;
+	batch_id = 0;
+	pending_tasks = 0;
+	workers_stopping = 0;
+	batch_events = NULL;
+	batch_tasks = NULL;
+	batch_capacity = 0;
+
+	if (count == 0) {
+		return;
 	}
-	
-	if (event_subscribers->event_id == event_id) {
-		last_dst_sub = malloc(sizeof(Subscriber));
-		memset(last_dst_sub, '\0', sizeof(Subscriber));
-		copy_subscriber(last_dst_sub, event_subscriber);
-		subscribers = last_dst_sub;
-	}
-	
-	cur_event_sub = event_subscribers;
-	while(cur_event_sub->next != NULL) {
-		if (cur_event_sub->event_id == event_id) {
-			if (subscribers == NULL) {
-				// handle the first subscriber found
-				subscribers = malloc(sizeof(Subscriber));
-				memset(subscribers, '\0', sizeof(Subscriber));
-				copy_subscriber(subscribers, cur_event_sub);
-				last_dst_sub = subscribers;
-			} else {
-				// handle subsequent subscribers
-				last_dst_sub->next = malloc(sizeof(Subscriber));
-				memset(last_dst_sub->next, '\0', sizeof(Subscriber));
-				copy_subscriber(last_dst_sub->next, cur_event_sub);
-				last_dst_sub = last_dst_sub->next;
-			}
+
+	if (count > MAX_WORKERS) {
+		LOG_WARN("Requested %u event workers. Limiting to %d.", count,
+			MAX_WORKERS);
+		count = MAX_WORKERS;
+	}
+
+	workers = malloc(sizeof(Worker) * count);
+	if (workers == NULL) {
+		LOG_ERROR("Could not create event workers. Insufficient memory. " \
+			"Events will be processed on the calling thread.");
+		return;
+	}
+	memset(workers, '\0', sizeof(Worker) * count);
+
+	mutex_init(&queue_lock);
+	mutex_init(&pool_lock);
+	cond_init(&work_cond);
+	cond_init(&done_cond);
+
+	for (i = 0; i < count; i++) {
+		mutex_init(&workers[i].lock);
+		if (!thread_create(&workers[i].thread, worker_main, &workers[i])) {
+			mutex_destroy(&workers[i].lock);
+			break;
 		}
-		cur_event_sub = cur_event_sub->next;
+		worker_count++;
 	}
-	
-	return subscribers;
+
+	LOG_DEBUG("Started %u event workers", worker_count);
 }
 
+/*
+ * Signals the workers to finish and waits for them before releasing the pool.
+ */
 static
 void
-copy_subscriber(Subscriber *dest, Subscriber *src) {
-	subscribers->id = event_subscribers->id;
-	subscribers->event_id = event_subscribers->event_id;
-	subscribers->callback = malloc(sizeof(ptrEventCallback));
-	memcpy(subscribers->callback, event_subscribers->callback, 
-		sizeof(ptrEventCallback));
+stop_workers() {
+	unsigned int i;
+
+	if (workers == NULL) {
+		return;
+	}
+
+	mutex_lock(&pool_lock);
+	workers_stopping = 1;
+	cond_broadcast(&work_cond);
+	mutex_unlock(&pool_lock);
+
+	// every worker must be gone before any deque goes as they steal
+	for (i = 0; i < worker_count; i++) {
+		thread_join(&workers[i].thread);
+	}
+
+	for (i = 0; i < worker_count; i++) {
+		mutex_destroy(&workers[i].lock);
+		free(workers[i].tasks);
+	}
+
+	mutex_destroy(&queue_lock);
+	mutex_destroy(&pool_lock);
+	cond_destroy(&work_cond);
+	cond_destroy(&done_cond);
+
+	free(workers);
+	free(batch_events);
+	free(batch_tasks);
+	workers = NULL;
+	worker_count = 0;
+	batch_events = NULL;
+	batch_tasks = NULL;
+	batch_capacity = 0;
+}
+
+/*
+ * Makes sure the batch arrays and every worker deque can hold count events
+ * worth of tasks (at most two tasks per event).
+ * Note: Call with the queue locked.
+ * Returns 1 if there is enough room.
+ */
+static
+unsigned int
+reserve_batch(unsigned int count) {
+	Event **events;
+	Task *tasks;
+	unsigned int i;
+
+	if (count <= batch_capacity) {
+		return 1;
+	}
+
+	events = realloc(batch_events, sizeof(Event *) * count);
+	if (events == NULL) {
+		return 0;
+	}
+	batch_events = events;
+	event_stats.batch_allocs++;
+
+	tasks = realloc(batch_tasks, sizeof(Task) * count * 2);
+	if (tasks == NULL) {
+		return 0;
+	}
+	batch_tasks = tasks;
+	event_stats.batch_allocs++;
+
+	for (i = 0; i < worker_count; i++) {
+		mutex_lock(&workers[i].lock);
+		tasks = realloc(workers[i].tasks, sizeof(Task) * count * 2);
+		if (tasks != NULL) {
+			workers[i].tasks = tasks;
+			workers[i].capacity = count * 2;
+			event_stats.batch_allocs++;
+		}
+		mutex_unlock(&workers[i].lock);
+
+		if (tasks == NULL) {
+			return 0;
+		}
+	}
+
+	batch_capacity = count;
+	return 1;
 }
 
+/*
+ * Dispatches the events currently on the queue using the worker pool and
+ * waits for all of them to complete.
+ * limit - the most events to take from the queue. 0 takes all of them.
+ * Returns the number of events processed.
+ */
 static
-Subscriber *
-get_last_subscriber() {
-	
+unsigned int
+process_parallel(unsigned int limit) {
+	Event *event;
+	Dispatch *dispatch;
+	Worker *worker;
+	Task *task;
+	unsigned int count;
+	unsigned int num_tasks = 0;
+	unsigned int i;
+	unsigned int w;
+#ifdef EVENT_INSTRUMENT
+	unsigned long long now;
+#endif
+
+	lock_queue();
+	count = peek_events();
+	if (limit > 0 && count > limit) {
+		count = limit;
+	}
+	if (count > 0 && !reserve_batch(count)) {
+		unlock_queue();
+		LOG_ERROR("Could not process events. Insufficient memory.");
+		return 0;
+	}
+	for (i = 0; i < count; i++) {
+		batch_events[i] = pop_event();
+	}
+	unlock_queue();
+
+#ifdef EVENT_INSTRUMENT
+	now = time_now_ns();
+#endif
+
+	// build one concurrent task per event and one strand per event ID with
+	// ordered subscribers
+	for (i = 0; i < count; i++) {
+		event = batch_events[i];
+		event->next = NULL;
+
+		dispatch = get_dispatch(event->id, 0);
+		if (dispatch == NULL) {
+			continue;
+		}
+
+#ifdef EVENT_INSTRUMENT
+		record_dispatch(dispatch, event, now);
+#endif
+
+		if (dispatch->count > dispatch->ordered) {
+			task = &batch_tasks[num_tasks++];
+			task->event = event;
+			task->dispatch = dispatch;
+			task->mode = EVENT_MODE_CONCURRENT;
+		}
+
+		if (dispatch->ordered > 0) {
+			if (dispatch->strand_tail == NULL) {
+				task = &batch_tasks[num_tasks++];
+				task->event = event;
+				task->dispatch = dispatch;
+				task->mode = EVENT_MODE_ORDERED;
+			} else {
+				dispatch->strand_tail->next = event;
+			}
+			dispatch->strand_tail = event;
+		}
+	}
+
+	// strands are complete so their tails are no longer needed
+	for (i = 0; i < num_tasks; i++) {
+		batch_tasks[i].dispatch->strand_tail = NULL;
+	}
+
+	if (num_tasks > 0) {
+		// the count must be in place before any task becomes visible as a
+		// worker still finishing the previous batch may take it straight away
+		__atomic_store_n(&pending_tasks, num_tasks, __ATOMIC_RELEASE);
+
+		// deal the tasks out to the workers
+		for (w = 0; w < worker_count; w++) {
+			worker = &workers[w];
+			mutex_lock(&worker->lock);
+			worker->top = 0;
+			worker->bottom = 0;
+			for (i = w; i < num_tasks; i += worker_count) {
+				worker->tasks[worker->bottom++] = batch_tasks[i];
+			}
+			mutex_unlock(&worker->lock);
+		}
+
+		mutex_lock(&pool_lock);
+		batch_id++;
+		cond_broadcast(&work_cond);
+		while (__atomic_load_n(&pending_tasks, __ATOMIC_ACQUIRE) > 0) {
+			cond_wait(&done_cond, &pool_lock);
+		}
+		mutex_unlock(&pool_lock);
+	}
+
+	lock_queue();
+	for (i = 0; i < count; i++) {
+		release_event(batch_events[i]);
+	}
+	unlock_queue();
+
+	return count;
 }
 
 void
 event_close() {
+	unsigned int i;
+
+	stop_workers();
 
+	// any events still on the queue are discarded along with the pool
+	while (peek_events() > 0) {
+		release_event(pop_event());
+	}
+	free_event_slabs();
+	timer_wheel_free(&timer_wheel);
+
+	for (i = 0; i < EVENT_LANES; i++) {
+		free(lanes[i].ring);
+	}
+	memset(lanes, '\0', sizeof(lanes));
+
+	free_dispatch(dense_dispatch, DENSE_EVENT_IDS);
+	free_dispatch(sparse_dispatch, MAX_SUBSCRIBERS);
+	sparse_count = 0;
 }
 
 unsigned int
 event_subscribe(unsigned int event_id, ptrEventCallback callback) {
+	return event_subscribe_mode(event_id, callback, EVENT_MODE_ORDERED);
+}
+
+unsigned int
+event_subscribe_mode(unsigned int event_id, ptrEventCallback callback,
+						unsigned char mode) {
+	Dispatch *dispatch;
+	Subscriber *subscribers;
 	Subscriber *subscriber;
-	Subscriber *cur_sub;
-	
-	LOG_DEBUG("Adding new subscriber to event ID %d...", event_id);
-	
-	subscriber = malloc(sizeof(Subscriber));
-	if (subscriber == NULL) {
-		LOG_SEVERE("Could not assign new subscriber for event %d. In " \
-			"sufficient memory.", event_id);
-		return;
+	unsigned int capacity;
+
+	LOG_DEBUG("Adding new subscriber to event ID %u...", event_id);
+
+	dispatch = get_dispatch(event_id, 1);
+	if (dispatch == NULL) {
+		return 0;
+	}
+
+	// grow the subscriber array for this event ID when it is full
+	if (dispatch->count == dispatch->capacity) {
+		capacity = dispatch->capacity > 0 ? dispatch->capacity * 2 : 4;
+		subscribers = realloc(dispatch->subscribers,
+			sizeof(Subscriber) * capacity);
+		if (subscribers == NULL) {
+			LOG_SEVERE("Could not assign new subscriber for event %u. In " \
+				"sufficient memory.", event_id);
+			return 0;
+		}
+		dispatch->subscribers = subscribers;
+		dispatch->capacity = capacity;
 	}
-	memset(subscriber, '\0', sizeof(Subscriber));
-	
+
+	subscriber = &dispatch->subscribers[dispatch->count++];
 	subscriber->id = ++last_subscriber_id;
 	subscriber->event_id = event_id;
-	
-	subscriber->callback = malloc(sizeof(ptrEventCallback));
-	if (subscriber->callback == NULL) {
-		LOG_SEVERE("Could not assign new subscriber for event %d. In " \
-			"sufficient memory.", event_id);
-		free(subscriber);
-		return;
+	subscriber->mode = mode;
+	subscriber->callback = callback;
+
+#ifdef EVENT_INSTRUMENT
+	subscriber->duration = malloc(sizeof(Histogram));
+	if (subscriber->duration != NULL) {
+		histogram_reset(subscriber->duration);
+	}
+#endif
+
+	if (mode == EVENT_MODE_ORDERED) {
+		dispatch->ordered++;
 	}
-	memcpy(subscriber->callback, callback, sizeof(ptrEventCallback));
-		
-	// add the subscriber to the list
-	queue_push(event_subscribers, subscriber);
-		
-	LOG_DEBUG("Subscriber added %d", subscriber->id);
+
+	LOG_DEBUG("Subscriber added %u", subscriber->id);
 	return subscriber->id;
 }
 
 void
-event_trigger(unsigned int event_id, void *data) {
-	Event *event;
-	
-	LOG_DEBUG("Triggering event with ID %d...", event_id);
-	// allocate resources for event and push it onto the back of the event queue
-	event = malloc(sizeof(Event));
-	if (event == NULL) {
-		LOG_ERROR("Could not trigger event. Insufficient memory.");
+event_trigger(unsigned int event_id, unsigned int size, void *data) {
+	event_trigger_priority(event_id, EVENT_PRIORITY_NORMAL, size, data);
+}
+
+void
+event_trigger_priority(unsigned int event_id, unsigned char priority,
+						unsigned int size, void *data) {
+	LOG_DEBUG("Triggering event with ID %u...", event_id);
+
+	if (priority >= EVENT_LANES) {
+		priority = EVENT_LANES - 1;
+	}
+
+	lock_queue();
+	queue_event(event_id, priority, size, data);
+	unlock_queue();
+}
+
+unsigned int
+event_set_coalesce(unsigned int event_id, unsigned char policy,
+					ptrEventReduce reduce) {
+	Dispatch *dispatch;
+
+	if (policy == EVENT_COALESCE_MERGE && reduce == NULL) {
+		LOG_ERROR("Could not set coalescing for event ID %u. Merging " \
+			"requires a reduce callback.", event_id);
+		return 0;
+	}
+
+	lock_queue();
+	dispatch = get_dispatch(event_id, 1);
+	if (dispatch != NULL) {
+		dispatch->coalesce = policy;
+		dispatch->reduce = reduce;
+	}
+	unlock_queue();
+
+	return dispatch != NULL;
+}
+
+unsigned int
+event_trigger_after(unsigned int event_id, unsigned int size, void *data,
+					unsigned int delay_ms) {
+	LOG_DEBUG("Triggering event with ID %u in %ums...", event_id, delay_ms);
+	return add_timer(event_id, size, data, delay_ms, 0);
+}
+
+unsigned int
+event_trigger_every(unsigned int event_id, unsigned int size, void *data,
+					unsigned int interval_ms) {
+	if (interval_ms == 0) {
+		interval_ms = 1;
+	}
+
+	LOG_DEBUG("Triggering event with ID %u every %ums...", event_id,
+		interval_ms);
+	return add_timer(event_id, size, data, interval_ms, interval_ms);
+}
+
+unsigned int
+event_cancel_timer(unsigned int timer) {
+	unsigned int cancelled;
+
+	lock_queue();
+	cancelled = timer_cancel(&timer_wheel, timer);
+	unlock_queue();
+
+	return cancelled;
+}
+
+unsigned long long
+event_next_deadline() {
+	unsigned long long expires;
+	unsigned long long now;
+
+	lock_queue();
+	expires = peek_events() > 0 ? 0 : timer_next_expiry(&timer_wheel);
+	unlock_queue();
+
+	if (expires == TIMER_NONE) {
+		return EVENT_NO_DEADLINE;
+	}
+
+	now = time_now_ns();
+	expires *= 1000000ULL;
+	return expires > now ? expires - now : 0;
+}
+
+void
+event_set_overflow_policy(unsigned char policy) {
+	overflow_policy = policy;
+}
+
+void
+event_set_drain_policy(unsigned char policy, unsigned long long guard_ns) {
+	lock_queue();
+	drain_policy = policy;
+	starvation_ns = guard_ns;
+	unlock_queue();
+}
+
+void
+event_set_lane_weight(unsigned char priority, unsigned int weight) {
+	if (priority >= EVENT_LANES) {
+		LOG_ERROR("Could not set weight. Priority %d does not exist.",
+			priority);
 		return;
 	}
-	memset(event, '\0', sizeof(Event));
-	
-	event->id = id;
-	event->data = data;
-	
-	if (queue_push(event_queue, event) > -1) {
-		// event pushed successfully
-		num_events++;
+
+	lock_queue();
+	lanes[priority].weight = weight > 0 ? weight : 1;
+	unlock_queue();
+}
+
+void
+event_get_stats(EventStats *stats) {
+	unsigned int i;
+
+	lock_queue();
+	memcpy(stats, &event_stats, sizeof(EventStats));
+	stats->queued = peek_events();
+	stats->capacity = 0;
+	for (i = 0; i < EVENT_LANES; i++) {
+		stats->lanes[i].queued = lane_depth(&lanes[i]);
+		stats->lanes[i].capacity = lanes[i].capacity;
+		stats->capacity += lanes[i].capacity;
+	}
+	unlock_queue();
+}
+
+/*
+ * Calls every subscriber of the event on the calling thread.
+ */
+static
+void
+dispatch_event(Event *event) {
+	Dispatch *dispatch;
+	unsigned int i;
+
+	dispatch = get_dispatch(event->id, 0);
+	if (dispatch != NULL) {
+		LOG_DEBUG("Subscribers found to handle event ID %u", event->id);
+
+#ifdef EVENT_INSTRUMENT
+		record_dispatch(dispatch, event, time_now_ns());
+#endif
+
+		for (i = 0; i < dispatch->count; i++) {
+			call_subscriber(dispatch, i, event);
+		}
 	}
 }
 
 unsigned int
 event_process() {
+	return event_process_budget(0, 0, NULL);
+}
+
+unsigned int
+event_process_budget(unsigned int max_events, unsigned long long max_ns,
+						EventBudget *budget) {
 	Event *event;
-	Subscribers *subscribers;
-	int events_processed = 0;
-	
-	// deal with all events currently on the queue
-	// TODO: may want to consider sticking a threshold on the number of
-	//		events we handle in each batch if there are noticable performance
-	//		issues.
-	while (peek_events() > 0) {
-		
-		event = (Event *)pop_event();
-		
-		subscribers = get_subscribers(event->id);
-		if (subscribers != NULL) {
-			LOG_DEBUG("Subscribers found to handle event ID %d", event->id);
-		}
-		
-		// The event should now be at the end of it's lifecycle and as such,
-		// it's resources can be freed
-		free(event);
-		events_processed++;
-	}
-	
+	unsigned long long start;
+	unsigned int limit;
+	unsigned int count;
+	unsigned int events_processed = 0;
+
+	start = time_now_ns();
+
+	// timers that have fallen due join the queue ahead of this batch
+	lock_queue();
+	timer_advance(&timer_wheel, start / 1000000ULL, fire_timer);
+	unlock_queue();
+
+	while (max_events == 0 || events_processed < max_events) {
+		if (worker_count > 0) {
+			// without a time limit the whole queue goes out in one batch,
+			// otherwise it is fed to the workers in slices
+			limit = max_events > 0 ? max_events - events_processed : 0;
+			if (max_ns > 0 && (limit == 0 || limit > worker_count *
+					WORKER_BATCH)) {
+				limit = worker_count * WORKER_BATCH;
+			}
+
+			count = process_parallel(limit);
+			events_processed += count;
+			if (count == 0 || max_ns == 0) {
+				break;
+			}
+		} else {
+			if (peek_events() == 0) {
+				break;
+			}
+
+			event = pop_event();
+			dispatch_event(event);
+
+			// The event should now be at the end of it's lifecycle and as
+			// such, it can go back to the pool
+			release_event(event);
+			events_processed++;
+		}
+
+		if (max_ns > 0 && time_now_ns() - start >= max_ns) {
+			break;
+		}
+	}
+
+	if (budget != NULL) {
+		budget->processed = events_processed;
+		lock_queue();
+		budget->remaining = peek_events();
+		unlock_queue();
+		budget->elapsed_ns = time_now_ns() - start;
+	}
+
 	return events_processed;
 }
+
+#ifdef EVENT_INSTRUMENT
+unsigned int
+event_snapshot_id(unsigned int event_id, EventIdSnapshot *snapshot) {
+	Dispatch *dispatch;
+	double seconds;
+
+	memset(snapshot, '\0', sizeof(EventIdSnapshot));
+	snapshot->event_id = event_id;
+
+	lock_queue();
+	dispatch = get_dispatch(event_id, 0);
+	if (dispatch == NULL) {
+		unlock_queue();
+		return 0;
+	}
+
+	snapshot->subscribers = dispatch->count;
+	snapshot->triggered = dispatch->triggered;
+	snapshot->coalesced = dispatch->coalesced;
+	unlock_queue();
+
+	snapshot->dispatched = __atomic_load_n(&dispatch->dispatched,
+		__ATOMIC_RELAXED);
+
+	seconds = (time_now_ns() - init_ns) / 1e9;
+	if (seconds > 0) {
+		snapshot->trigger_rate = snapshot->triggered / seconds;
+		snapshot->dispatch_rate = snapshot->dispatched / seconds;
+	}
+
+	if (dispatch->latency != NULL) {
+		snapshot->latency_p50_ns = histogram_percentile(dispatch->latency,
+			0.5);
+		snapshot->latency_p99_ns = histogram_percentile(dispatch->latency,
+			0.99);
+		snapshot->latency_p999_ns = histogram_percentile(dispatch->latency,
+			0.999);
+		snapshot->latency_max_ns = dispatch->latency->max;
+	}
+
+	return 1;
+}
+
+unsigned int
+event_snapshot_subscriber(unsigned int event_id, unsigned int subscriber_id,
+							EventSubscriberSnapshot *snapshot) {
+	Dispatch *dispatch;
+	Histogram *duration = NULL;
+	unsigned int i;
+
+	memset(snapshot, '\0', sizeof(EventSubscriberSnapshot));
+	snapshot->id = subscriber_id;
+	snapshot->event_id = event_id;
+
+	dispatch = get_dispatch(event_id, 0);
+	if (dispatch == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < dispatch->count; i++) {
+		if (dispatch->subscribers[i].id == subscriber_id) {
+			duration = dispatch->subscribers[i].duration;
+			break;
+		}
+	}
+
+	if (duration == NULL) {
+		return 0;
+	}
+
+	snapshot->calls = __atomic_load_n(&duration->count, __ATOMIC_RELAXED);
+	snapshot->total_ns = __atomic_load_n(&duration->sum, __ATOMIC_RELAXED);
+	snapshot->duration_p50_ns = histogram_percentile(duration, 0.5);
+	snapshot->duration_p99_ns = histogram_percentile(duration, 0.99);
+	snapshot->duration_p999_ns = histogram_percentile(duration, 0.999);
+	snapshot->duration_max_ns = duration->max;
+
+	return 1;
+}
+#endif
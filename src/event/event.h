@@ -1,29 +1,172 @@
 #ifndef EVENT_H
 #define EVENT_H
 
-typedef (*ptrEventCallback)(unsigned int size, char *data);
+/*
+ * Overflow policies used when an event is triggered while the queue is full.
+ */
+#define EVENT_OVERFLOW_DROP_NEWEST	1	// discard the event being triggered
+#define EVENT_OVERFLOW_DROP_OLDEST	2	// discard the event at the front
+#define EVENT_OVERFLOW_GROW			3	// double the size of the queue
+
+/*
+ * Priority lanes. Each lane has its own queue and lane 0 is the most urgent.
+ */
+#define EVENT_LANES					4
+#define EVENT_PRIORITY_CRITICAL		0	// shutdown, config reload, etc.
+#define EVENT_PRIORITY_HIGH			1
+#define EVENT_PRIORITY_NORMAL		2	// used by event_trigger()
+#define EVENT_PRIORITY_LOW			3	// bulk work such as telemetry
+
+/*
+ * Policies for choosing which lane is drained next.
+ */
+#define EVENT_DRAIN_STRICT			1	// highest non-empty lane first
+#define EVENT_DRAIN_WEIGHTED		2	// weighted round-robin between lanes
+
+/*
+ * Default time an event may wait in a lower lane under EVENT_DRAIN_STRICT
+ * before it is served ahead of the lanes above it.
+ */
+#define EVENT_STARVATION_NS			100000000ULL
+
+/*
+ * Coalescing policies. When an event ID coalesces, triggering it while one of
+ * its events is still queued updates the queued event instead of adding
+ * another one.
+ */
+#define EVENT_COALESCE_NONE			0
+#define EVENT_COALESCE_KEEP_LATEST	1	// the queued event takes the new data
+#define EVENT_COALESCE_KEEP_FIRST	2	// the new data is discarded
+#define EVENT_COALESCE_MERGE		3	// a reduce callback combines the two
+
+/*
+ * Returned by event_next_deadline() when nothing is queued or scheduled.
+ */
+#define EVENT_NO_DEADLINE			0xFFFFFFFFFFFFFFFFULL
+
+/*
+ * Subscriber modes. These only matter when event_init() starts workers.
+ */
+#define EVENT_MODE_ORDERED			0	// calls are serialised per event ID
+#define EVENT_MODE_CONCURRENT		1	// calls may run on any worker at once
+
+typedef void (*ptrEventCallback)(unsigned int size, char *data);
 
 struct sSubscriber {
 	unsigned int id;
 	unsigned int event_id;
+	unsigned char mode;
 	ptrEventCallback callback;
+#ifdef EVENT_INSTRUMENT
+	struct sHistogram *duration;	// time spent in each call
+#endif
 };
 
 typedef struct sSubscriber Subscriber;
 
 struct sEvent {
 	unsigned int id;
+	unsigned int size;
 	void *data;
+	unsigned long long queued_ns;	// when the event was placed in its lane
+	unsigned char coalescing;		// later triggers may fold into the event
+	struct sEvent *next;
 };
 
 typedef struct sEvent Event;
 
-/* 
+/*
+ * Called under EVENT_COALESCE_MERGE to fold a new trigger (size and data) into
+ * the event still waiting on the queue. The callback updates queued in place.
+ * Note: The callback runs inside event_trigger() while the queue is held, so it
+ *		must not trigger events itself.
+ */
+typedef void (*ptrEventReduce)(Event *queued, unsigned int size, void *data);
+
+struct sEventLaneStats {
+	unsigned int queued;			// events currently waiting in the lane
+	unsigned int capacity;			// number of slots in the lane
+	unsigned int high_water;		// most events ever waiting in the lane
+	unsigned int enqueued;			// events placed in the lane
+	unsigned int dispatched;		// events taken from the lane
+	unsigned int promoted;			// times the starvation guard served it
+	unsigned long long total_wait_ns;	// summed queue wait of taken events
+	unsigned long long max_wait_ns;	// longest queue wait of a taken event
+};
+
+typedef struct sEventLaneStats EventLaneStats;
+
+struct sEventStats {
+	unsigned int queued;			// events currently waiting on the queue
+	unsigned int capacity;			// number of slots across all lanes
+	unsigned int dropped_newest;	// events discarded by DROP_NEWEST
+	unsigned int dropped_oldest;	// events discarded by DROP_OLDEST
+	unsigned int grown;				// number of times the queue was resized
+	unsigned int pool_slabs;		// slabs of events allocated by the pool
+	unsigned int pool_in_use;		// events currently handed out by the pool
+	unsigned int pool_high_water;	// most events handed out at once
+	unsigned int pool_acquired;		// events handed out since event_init()
+	unsigned int coalesced;			// triggers folded into a queued event
+	unsigned int batch_allocs;		// allocations made growing worker batches
+	EventLaneStats lanes[EVENT_LANES];
+};
+
+typedef struct sEventStats EventStats;
+
+struct sEventBudget {
+	unsigned int processed;			// events dispatched in the call
+	unsigned int remaining;			// events still waiting on the queue
+	unsigned long long elapsed_ns;	// time spent in the call
+};
+
+typedef struct sEventBudget EventBudget;
+
+#ifdef EVENT_INSTRUMENT
+/*
+ * Instrumentation is only compiled in when EVENT_INSTRUMENT is defined.
+ * Rates are averaged over the time since event_init(). Percentiles come from
+ * log-linear histograms and are accurate to about 12%.
+ */
+struct sEventIdSnapshot {
+	unsigned int event_id;
+	unsigned int subscribers;
+	unsigned long long triggered;		// includes coalesced triggers
+	unsigned long long dispatched;
+	unsigned long long coalesced;
+	double trigger_rate;				// triggers per second
+	double dispatch_rate;				// dispatches per second
+	unsigned long long latency_p50_ns;	// time from trigger to dispatch
+	unsigned long long latency_p99_ns;
+	unsigned long long latency_p999_ns;
+	unsigned long long latency_max_ns;
+};
+
+typedef struct sEventIdSnapshot EventIdSnapshot;
+
+struct sEventSubscriberSnapshot {
+	unsigned int id;
+	unsigned int event_id;
+	unsigned long long calls;
+	unsigned long long total_ns;		// time spent in the callback
+	unsigned long long duration_p50_ns;
+	unsigned long long duration_p99_ns;
+	unsigned long long duration_p999_ns;
+	unsigned long long duration_max_ns;
+};
+
+typedef struct sEventSubscriberSnapshot EventSubscriberSnapshot;
+#endif
+
+/*
  * Initialises resources required for event processing.
+ * queue_size is the initial number of slots in each priority lane and is
+ *		rounded up to a power of two. Passing 0 uses the default of 1024.
+ * workers is the number of threads used to dispatch events. Passing 0 keeps
+ *		all dispatching on the thread that calls event_process().
  * Note: event_close() MUST be explicitly called to free the resources once
  * you are done using the event handler.
- */ 
-void event_init();
+ */
+void event_init(unsigned int queue_size, unsigned int workers);
 
 /*
  * Free resources associated with event handling.
@@ -32,27 +175,153 @@ void event_close();
 
 /*
  * Checks if there are any events waiting on the queue and makes calls to the
- * correct places based on their types. This is not a blocking call and will
- * return even if no events were processed.
+ * correct places based on their types. Timed events that have fallen due are
+ * queued first. This is not a blocking call and will return even if no events
+ * were processed.
  * Returns an unsigned int which holds the number of events that were
  * processed in this call.
+ * With workers, the events queued at the time of the call are shared between
+ * the workers and the call returns once all of them have been dispatched.
+ * Events triggered by subscribers during the call are left for the next one.
  */
 unsigned int event_process();
 
 /*
- * The caller subscribes to a particular event by supplying an event ID and 
+ * Same as event_process() but stops once max_events events have been
+ * processed or max_ns nanoseconds have passed, whichever comes first. Passing
+ * 0 for either removes that limit. Events are still processed in FIFO order
+ * and any left over are handled by the next call.
+ * The time limit is checked between events (or between batches when workers
+ * are used), so a slow subscriber can overrun it.
+ * budget is optional and receives the counts and time taken by the call.
+ * Returns the number of events processed.
+ */
+unsigned int event_process_budget(unsigned int max_events,
+									unsigned long long max_ns,
+									EventBudget *budget);
+
+/*
+ * The caller subscribes to a particular event by supplying an event ID and
  * corresponding callback method function pointer. When an event with the
  * specified ID is encountered event_process(), the callback method
  * will be called.
  * Returns an unsigned int which is the unique handle of event ID and callback
  * combination.
+ * Note: Subscribers should not be added while event_process() is running on
+ *		workers.
  */
 unsigned int event_subscribe(unsigned int event_id, ptrEventCallback callback);
 
 /*
- * 
+ * Same as event_subscribe() but lets the caller choose how the callback may
+ * be called by workers.
+ * mode takes a single EVENT_MODE_x value. event_subscribe() uses
+ *		EVENT_MODE_ORDERED.
+ */
+unsigned int event_subscribe_mode(unsigned int event_id,
+									ptrEventCallback callback,
+									unsigned char mode);
+
+/*
+ * Places a new event on the back of the EVENT_PRIORITY_NORMAL lane. size and
+ * data are handed to each subscriber of event_id when the event is processed.
+ * Note: data is not copied. It must remain valid until the event has been
+ *		processed.
+ */
+void event_trigger(unsigned int event_id, unsigned int size, void *data);
+
+/*
+ * Same as event_trigger() but places the event in the lane for the specified
+ * priority, which takes a single EVENT_PRIORITY_x value.
  */
-void event_trigger(unsigned int event_id);
+void event_trigger_priority(unsigned int event_id, unsigned char priority,
+							unsigned int size, void *data);
 
+/*
+ * Sets how repeated triggers of an event ID are coalesced while one of its
+ * events is waiting on the queue.
+ * policy takes a single EVENT_COALESCE_x value.
+ * reduce is required by EVENT_COALESCE_MERGE and ignored otherwise.
+ * Returns 1 if the policy was set.
+ */
+unsigned int event_set_coalesce(unsigned int event_id, unsigned char policy,
+								ptrEventReduce reduce);
+
+/*
+ * Triggers the event once delay_ms milliseconds have passed. The event is
+ * queued by the first event_process() call after that.
+ * Returns a handle which can be passed to event_cancel_timer() or 0 if the
+ * timer could not be created.
+ */
+unsigned int event_trigger_after(unsigned int event_id, unsigned int size,
+									void *data, unsigned int delay_ms);
+
+/*
+ * Triggers the event every interval_ms milliseconds until it is cancelled.
+ * Returns a handle which can be passed to event_cancel_timer() or 0 if the
+ * timer could not be created.
+ */
+unsigned int event_trigger_every(unsigned int event_id, unsigned int size,
+									void *data, unsigned int interval_ms);
+
+/*
+ * Stops a pending timed event.
+ * Returns 1 if the timer was cancelled or 0 if it had already fired (for
+ * single shots) or been cancelled.
+ */
+unsigned int event_cancel_timer(unsigned int timer);
+
+/*
+ * Returns the number of nanoseconds until the next timed event falls due, 0 if
+ * events are already waiting or EVENT_NO_DEADLINE if there is nothing to do.
+ * Callers can sleep for this long before calling event_process() again.
+ */
+unsigned long long event_next_deadline();
+
+/*
+ * Sets what happens when an event is triggered while the queue is full.
+ * policy takes a single EVENT_OVERFLOW_x value. Defaults to
+ * EVENT_OVERFLOW_DROP_NEWEST.
+ */
+void event_set_overflow_policy(unsigned char policy);
+
+/*
+ * Sets how event_process() chooses between the priority lanes.
+ * policy takes a single EVENT_DRAIN_x value. Defaults to EVENT_DRAIN_STRICT.
+ * guard_ns is the starvation guard used by EVENT_DRAIN_STRICT. Passing 0
+ *		disables it. Defaults to EVENT_STARVATION_NS.
+ */
+void event_set_drain_policy(unsigned char policy, unsigned long long guard_ns);
+
+/*
+ * Sets how many events a lane may hand out per turn under
+ * EVENT_DRAIN_WEIGHTED. Defaults to 8, 4, 2 and 1 from the most urgent lane
+ * down.
+ */
+void event_set_lane_weight(unsigned char priority, unsigned int weight);
+
+/*
+ * Copies the current queue statistics into stats.
+ */
+void event_get_stats(EventStats *stats);
+
+#ifdef EVENT_INSTRUMENT
+/*
+ * Copies the instrumentation gathered for an event ID into snapshot. Queue
+ * depth high-water marks are reported per lane by event_get_stats().
+ * Only event IDs with subscribers or a coalescing policy are tracked.
+ * Returns 1 if the event ID is tracked.
+ */
+unsigned int event_snapshot_id(unsigned int event_id,
+								EventIdSnapshot *snapshot);
+
+/*
+ * Copies the call timings gathered for a single subscriber into snapshot.
+ * Returns 1 if the subscriber was found.
+ */
+unsigned int event_snapshot_subscriber(unsigned int event_id,
+										unsigned int subscriber_id,
+										EventSubscriberSnapshot *snapshot);
+#endif
 
-#endif
\ No newline at end of file
+#endif
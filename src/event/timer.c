@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer.h"
+#include "../util/log/log.h"
+
+/*
+ * Handles hold the timer's index (plus one) in the low bits and its
+ * generation in the high bits, so a handle goes stale once its timer has
+ * fired or been cancelled.
+ */
+#define TIMER_INDEX_BITS	20
+#define TIMER_INDEX_MASK	((1u << TIMER_INDEX_BITS) - 1)
+#define TIMER_MAX			TIMER_INDEX_MASK
+#define TIMER_RANGE			(1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS))
+
+/*
+ * Places a timer at the head of the specified list.
+ */
+static
+void
+link_timer(TimerWheel *wheel, unsigned int index, unsigned int *list) {
+	Timer *timer = &wheel->timers[index - 1];
+
+	timer->list = list;
+	timer->prev = 0;
+	timer->next = *list;
+	if (*list != 0) {
+		wheel->timers[*list - 1].prev = index;
+	}
+	*list = index;
+}
+
+/*
+ * Removes a timer from whichever list currently holds it.
+ */
+static
+void
+unlink_timer(TimerWheel *wheel, unsigned int index) {
+	Timer *timer = &wheel->timers[index - 1];
+
+	if (timer->prev != 0) {
+		wheel->timers[timer->prev - 1].next = timer->next;
+	} else {
+		*timer->list = timer->next;
+	}
+
+	if (timer->next != 0) {
+		wheel->timers[timer->next - 1].prev = timer->prev;
+	}
+
+	timer->list = NULL;
+	timer->prev = 0;
+	timer->next = 0;
+}
+
+/*
+ * Puts a timer into the slot matching its expiry. Timers beyond the range of
+ * the wheel are parked in the top level and re-placed when they cascade.
+ * A timer expiring at the current time goes into the current level 0 slot,
+ * which timer_advance() collects straight after cascading.
+ * Note: The expiry must not be before the current time.
+ */
+static
+void
+place_timer(TimerWheel *wheel, unsigned int index) {
+	Timer *timer = &wheel->timers[index - 1];
+	unsigned long long expires;
+	unsigned long long delta;
+	unsigned int level;
+	unsigned int slot;
+
+	expires = timer->expires;
+	delta = expires - wheel->now;
+	if (delta >= TIMER_RANGE) {
+		expires = wheel->now + TIMER_RANGE - 1;
+		delta = TIMER_RANGE - 1;
+	}
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++) {
+		if (delta < (1ULL << (TIMER_SLOT_BITS * (level + 1)))) {
+			break;
+		}
+	}
+
+	slot = (expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+	link_timer(wheel, index, &wheel->slots[level][slot]);
+}
+
+/*
+ * Returns a timer to the free list and bumps its generation so existing
+ * handles no longer match.
+ */
+static
+void
+free_timer(TimerWheel *wheel, unsigned int index) {
+	Timer *timer = &wheel->timers[index - 1];
+
+	timer->generation++;
+	timer->list = NULL;
+	timer->next = wheel->free_list;
+	wheel->free_list = index;
+	wheel->count--;
+}
+
+/*
+ * Moves every timer in the current slot of a level down to the levels below.
+ * Returns the index of the slot that was emptied.
+ */
+static
+unsigned int
+cascade(TimerWheel *wheel, unsigned int level) {
+	unsigned int slot;
+	unsigned int index;
+	unsigned int next;
+
+	slot = (wheel->now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+
+	index = wheel->slots[level][slot];
+	wheel->slots[level][slot] = 0;
+	while (index != 0) {
+		next = wheel->timers[index - 1].next;
+		place_timer(wheel, index);
+		index = next;
+	}
+
+	return slot;
+}
+
+/*
+ * Doubles the number of timers the wheel can hold and adds the new ones to
+ * the free list.
+ * Returns 1 if the wheel was grown.
+ */
+static
+unsigned int
+grow_timers(TimerWheel *wheel) {
+	Timer *timers;
+	unsigned int capacity;
+	unsigned int i;
+
+	capacity = wheel->capacity > 0 ? wheel->capacity * 2 : 64;
+	if (capacity > TIMER_MAX) {
+		capacity = TIMER_MAX;
+	}
+	if (capacity <= wheel->capacity) {
+		LOG_ERROR("Could not add timer. Limit of %u timers reached.",
+			TIMER_MAX);
+		return 0;
+	}
+
+	timers = realloc(wheel->timers, sizeof(Timer) * capacity);
+	if (timers == NULL) {
+		LOG_ERROR("Could not add timer. Insufficient memory.");
+		return 0;
+	}
+	memset(&timers[wheel->capacity], '\0',
+		sizeof(Timer) * (capacity - wheel->capacity));
+
+	// thread the new timers onto the free list, lowest index first
+	for (i = capacity; i > wheel->capacity; i--) {
+		timers[i - 1].next = wheel->free_list;
+		wheel->free_list = i;
+	}
+
+	wheel->timers = timers;
+	wheel->capacity = capacity;
+	return 1;
+}
+
+void
+timer_wheel_init(TimerWheel *wheel, unsigned long long now) {
+	memset(wheel, '\0', sizeof(TimerWheel));
+	wheel->now = now;
+}
+
+void
+timer_wheel_free(TimerWheel *wheel) {
+	free(wheel->timers);
+	memset(wheel, '\0', sizeof(TimerWheel));
+}
+
+Timer *
+timer_add(TimerWheel *wheel, unsigned long long expires,
+			unsigned int interval, unsigned int *handle) {
+	Timer *timer;
+	unsigned int index;
+
+	if (wheel->free_list == 0 && !grow_timers(wheel)) {
+		return NULL;
+	}
+
+	index = wheel->free_list;
+	timer = &wheel->timers[index - 1];
+	wheel->free_list = timer->next;
+	wheel->count++;
+
+	// anything already overdue fires on the next tick
+	if (expires <= wheel->now) {
+		expires = wheel->now + 1;
+	}
+
+	timer->expires = expires;
+	timer->interval = interval;
+	timer->event_id = 0;
+	timer->size = 0;
+	timer->data = NULL;
+	place_timer(wheel, index);
+
+	*handle = index | (timer->generation << TIMER_INDEX_BITS);
+	return timer;
+}
+
+unsigned int
+timer_cancel(TimerWheel *wheel, unsigned int handle) {
+	Timer *timer;
+	unsigned int index;
+
+	index = handle & TIMER_INDEX_MASK;
+	if (index == 0 || index > wheel->capacity) {
+		return 0;
+	}
+
+	timer = &wheel->timers[index - 1];
+	if (timer->list == NULL || (timer->generation <<
+			TIMER_INDEX_BITS) != (handle & ~TIMER_INDEX_MASK)) {
+		return 0;
+	}
+
+	unlink_timer(wheel, index);
+	free_timer(wheel, index);
+	return 1;
+}
+
+void
+timer_advance(TimerWheel *wheel, unsigned long long now,
+				ptrTimerExpired expired) {
+	Timer *timer;
+	unsigned int slot;
+	unsigned int level;
+	unsigned int index;
+
+	while (wheel->now < now) {
+		// nothing can fire so jump straight to the new time
+		if (wheel->count == 0) {
+			wheel->now = now;
+			break;
+		}
+
+		wheel->now++;
+		slot = wheel->now & (TIMER_SLOTS - 1);
+
+		// each time a level wraps the next level up cascades a slot down
+		for (level = 1; slot == 0 && level < TIMER_LEVELS; level++) {
+			slot = cascade(wheel, level);
+		}
+
+		// collect the timers due this tick before calling out
+		slot = wheel->now & (TIMER_SLOTS - 1);
+		while ((index = wheel->slots[0][slot]) != 0) {
+			unlink_timer(wheel, index);
+			link_timer(wheel, index, &wheel->firing);
+		}
+
+		while ((index = wheel->firing) != 0) {
+			unlink_timer(wheel, index);
+			timer = &wheel->timers[index - 1];
+
+			expired(timer);
+
+			if (timer->interval > 0) {
+				timer->expires += timer->interval;
+				place_timer(wheel, index);
+			} else {
+				free_timer(wheel, index);
+			}
+		}
+	}
+}
+
+unsigned long long
+timer_next_expiry(TimerWheel *wheel) {
+	unsigned long long next = TIMER_NONE;
+	unsigned int level;
+	unsigned int current;
+	unsigned int slot;
+	unsigned int index;
+	unsigned int i;
+
+	if (wheel->count == 0) {
+		return TIMER_NONE;
+	}
+
+	// the first occupied slot after the current one holds the earliest
+	// timers of each level
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		current = (wheel->now >> (TIMER_SLOT_BITS * level)) &
+			(TIMER_SLOTS - 1);
+
+		for (i = 1; i <= TIMER_SLOTS; i++) {
+			slot = (current + i) & (TIMER_SLOTS - 1);
+			index = wheel->slots[level][slot];
+			if (index == 0) {
+				continue;
+			}
+
+			while (index != 0) {
+				if (wheel->timers[index - 1].expires < next) {
+					next = wheel->timers[index - 1].expires;
+				}
+				index = wheel->timers[index - 1].next;
+			}
+			break;
+		}
+	}
+
+	return next;
+}
@@ -0,0 +1,93 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/*
+ * Hierarchical timing wheel used by the event handler for delayed and
+ * periodic events. Time is measured in ticks (milliseconds for the event
+ * handler). Each level has TIMER_SLOTS slots and covers TIMER_SLOTS times the
+ * range of the level below it. Timers are moved down a level as their expiry
+ * draws near, so adding, cancelling and firing a timer are all O(1).
+ */
+
+#define TIMER_LEVELS		5
+#define TIMER_SLOT_BITS		6
+#define TIMER_SLOTS			(1 << TIMER_SLOT_BITS)
+
+#define TIMER_NONE			0xFFFFFFFFFFFFFFFFULL
+
+/*
+ * Timers live in a single array and are linked by index (plus one, so 0 means
+ * no timer). list points at the head of the slot currently holding the timer
+ * and is NULL while the timer is unused.
+ */
+struct sTimer {
+	unsigned long long expires;
+	unsigned int interval;		// ticks between firings, 0 for a single shot
+	unsigned int generation;
+	unsigned int prev;
+	unsigned int next;
+	unsigned int *list;
+
+	// payload of the event to trigger on expiry
+	unsigned int event_id;
+	unsigned int size;
+	void *data;
+};
+
+typedef struct sTimer Timer;
+
+struct sTimerWheel {
+	Timer *timers;
+	unsigned int capacity;
+	unsigned int count;
+	unsigned int free_list;
+	unsigned int firing;		// timers expiring in the current tick
+	unsigned long long now;
+	unsigned int slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+typedef struct sTimerWheel TimerWheel;
+
+typedef void (*ptrTimerExpired)(Timer *timer);
+
+/*
+ * Prepares an empty wheel starting at tick now.
+ */
+void timer_wheel_init(TimerWheel *wheel, unsigned long long now);
+
+/*
+ * Frees every timer held by the wheel.
+ */
+void timer_wheel_free(TimerWheel *wheel);
+
+/*
+ * Adds a timer expiring at the given tick. interval makes the timer repeat
+ * every interval ticks after that.
+ * handle receives the handle used to cancel the timer.
+ * Returns the new timer so its payload can be filled in or NULL if it could
+ * not be allocated.
+ * Note: The pointer is only valid until the next call to timer_add().
+ */
+Timer *timer_add(TimerWheel *wheel, unsigned long long expires,
+					unsigned int interval, unsigned int *handle);
+
+/*
+ * Cancels a pending timer.
+ * Returns 1 if the timer was cancelled or 0 if the handle is stale.
+ */
+unsigned int timer_cancel(TimerWheel *wheel, unsigned int handle);
+
+/*
+ * Moves the wheel forward to tick now, calling expired for every timer that
+ * falls due on the way. Periodic timers are re-armed after expired returns.
+ */
+void timer_advance(TimerWheel *wheel, unsigned long long now,
+					ptrTimerExpired expired);
+
+/*
+ * Returns the tick the next timer is due at or TIMER_NONE if the wheel is
+ * empty.
+ */
+unsigned long long timer_next_expiry(TimerWheel *wheel);
+
+#endif
@@ -84,7 +84,7 @@ main(int argc, char **argv) {
 	
 	load_config();
 	
-	event_init();
+	event_init(0, 0);
 	
 	event_subscribe(1, (ptrEventCallback)&test_event);
 	event_close();
@@ -1,7 +1,19 @@
 mingw32-gcc -DDEBUG -DCONFIG_LOCATION=vectir.conf -o vectir.exe ^
 	main.c util/log/log.c ^
+	util/log/logbinary.c ^
+	util/log/logfile.c ^
 	util/config/config.c ^
+	util/misc/arena.c ^
+	util/misc/epoch.c ^
+	util/misc/filewatch.c ^
 	util/misc/stringutils.c ^
 	util/misc/queue.c ^
-	event/event.c
+	util/misc/mpmc.c ^
+	util/misc/spsc.c ^
+	util/misc/thread.c ^
+	util/misc/timeutils.c ^
+	util/misc/histogram.c ^
+	util/misc/mapfile.c ^
+	event/event.c ^
+	event/timer.c
 	
\ No newline at end of file
@@ -0,0 +1,9 @@
+mingw32-gcc -O2 -o tools/logdecode.exe ^
+	tools/logdecode.c ^
+	util/log/log.c ^
+	util/log/logbinary.c ^
+	util/log/logfile.c ^
+	util/misc/mapfile.c ^
+	util/misc/mpmc.c ^
+	util/misc/thread.c ^
+	util/misc/timeutils.c
@@ -0,0 +1,315 @@
+/*
+ * Binary log decoder.
+ *
+ * Expands a log written with LOG_BINARY back into the "[LEVEL] message" text
+ * form, one message per line on stdout. Passing -t prefixes each line with the
+ * seconds since the log was opened.
+ *
+ * Usage: logdecode [-t] <binary log>
+ *
+ * Built by tools.bat, or on Linux from the src directory with:
+ *	gcc -O2 -o tools/logdecode tools/logdecode.c util/log/log.c \
+ *		util/log/logbinary.c util/log/logfile.c util/misc/mapfile.c \
+ *		util/misc/mpmc.c util/misc/thread.c util/misc/timeutils.c -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../util/log/log.h"
+#include "../util/log/logbinary.h"
+#include "../util/misc/mapfile.h"
+
+#define MAX_SPEC			32
+
+/*
+ * Format strings by ID. They point straight into the mapped log.
+ */
+static const char **formats;
+static unsigned int format_capacity;
+
+/*
+ * Remembers the text of a format record.
+ * Returns true if it could be stored.
+ */
+static
+unsigned int
+add_format(unsigned int id, const char *fmt) {
+	const char **grown;
+	unsigned int capacity;
+
+	if (id >= format_capacity) {
+		capacity = format_capacity > 0 ? format_capacity : 64;
+		while (capacity <= id) {
+			capacity *= 2;
+		}
+
+		grown = realloc(formats, sizeof(char *) * capacity);
+		if (grown == NULL) {
+			fprintf(stderr, "Insufficient memory for formats\n");
+			return 0;
+		}
+		memset(grown + format_capacity, '\0',
+			sizeof(char *) * (capacity - format_capacity));
+
+		formats = grown;
+		format_capacity = capacity;
+	}
+
+	formats[id] = fmt;
+	return 1;
+}
+
+/*
+ * Copies size bytes of argument data, checking they are inside the record.
+ * Returns true if they were.
+ */
+static
+unsigned int
+take(const char **data, const char *end, void *value, unsigned int size) {
+	if ((unsigned int)(end - *data) < size) {
+		return 0;
+	}
+
+	memcpy(value, *data, size);
+	*data += size;
+	return 1;
+}
+
+/*
+ * Rebuilds a single conversion for printing. Length modifiers wider than int
+ * are dropped and those integers are printed as long long, which is how they
+ * were stored. h and hh are kept so the stored int is narrowed as it was in
+ * the text log.
+ */
+static
+void
+build_spec(const LogSpec *spec, char *out) {
+	unsigned int i;
+	unsigned int j = 0;
+
+	for (i = 0; i < spec->length - 1 && j < MAX_SPEC - 4; i++) {
+		if (strchr("lLqjzt", spec->start[i]) == NULL) {
+			out[j++] = spec->start[i];
+		}
+	}
+
+	if (spec->type == LOG_ARG_LONG || spec->type == LOG_ARG_LONG_LONG ||
+			spec->type == LOG_ARG_SIZE || spec->type == LOG_ARG_PTRDIFF) {
+		out[j++] = 'l';
+		out[j++] = 'l';
+	}
+
+	out[j++] = spec->start[spec->length - 1];
+	out[j] = '\0';
+}
+
+/*
+ * Prints a value with up to two '*' arguments ahead of it.
+ */
+#define PRINT_VALUE(spec, stars, star_values, value) \
+	do { \
+		if ((stars) == 0) { \
+			printf(spec, value); \
+		} else if ((stars) == 1) { \
+			printf(spec, (star_values)[0], value); \
+		} else { \
+			printf(spec, (star_values)[0], (star_values)[1], value); \
+		} \
+	} while (0)
+
+/*
+ * Prints a message by walking its format and pulling each argument out of
+ * the record data.
+ * Returns false if the record ended early.
+ */
+static
+unsigned int
+print_message(const char *fmt, const char *data, const char *end) {
+	LogSpec spec;
+	const char *next;
+	char format[MAX_SPEC];
+	char text[LOG_RECORD_SIZE + 1];
+	int star_values[2];
+	unsigned int length;
+	unsigned int i;
+	long long i_arg;
+	double d_arg;
+	int int_arg;
+
+	while ((next = logbinary_next_spec(fmt, &spec)) != NULL) {
+		fwrite(fmt, 1, spec.start - fmt, stdout);
+		fmt = next;
+
+		if (spec.type == LOG_ARG_NONE) {
+			putchar('%');
+			continue;
+		}
+
+		for (i = 0; i < spec.stars; i++) {
+			if (!take(&data, end, &int_arg, sizeof(int))) {
+				return 0;
+			}
+			if (i < 2) {
+				star_values[i] = int_arg;
+			}
+		}
+
+		build_spec(&spec, format);
+		switch (spec.type) {
+			case LOG_ARG_INT:
+				if (!take(&data, end, &int_arg, sizeof(int))) {
+					return 0;
+				}
+				PRINT_VALUE(format, spec.stars, star_values, int_arg);
+				break;
+
+			case LOG_ARG_DOUBLE:
+				if (!take(&data, end, &d_arg, sizeof(double))) {
+					return 0;
+				}
+				PRINT_VALUE(format, spec.stars, star_values, d_arg);
+				break;
+
+			case LOG_ARG_POINTER:
+				if (!take(&data, end, &i_arg, sizeof(long long))) {
+					return 0;
+				}
+				PRINT_VALUE(format, spec.stars, star_values,
+					(void *)(size_t)i_arg);
+				break;
+
+			case LOG_ARG_STRING:
+				if (!take(&data, end, &length, sizeof(unsigned int)) ||
+						length > LOG_RECORD_SIZE ||
+						!take(&data, end, text, length)) {
+					return 0;
+				}
+				text[length] = '\0';
+				PRINT_VALUE(format, spec.stars, star_values, text);
+				break;
+
+			case LOG_ARG_INVALID:
+				return 0;
+
+			default:
+				if (!take(&data, end, &i_arg, sizeof(long long))) {
+					return 0;
+				}
+				PRINT_VALUE(format, spec.stars, star_values, i_arg);
+				break;
+		}
+	}
+
+	fputs(fmt, stdout);
+	return 1;
+}
+
+/*
+ * Prints every complete message in the log.
+ * Returns the number of messages printed.
+ */
+static
+unsigned int
+decode(const MapFile *map, unsigned char timestamps) {
+	const LogBinaryHeader *header = map->data;
+	const LogBinaryRecord *record;
+	const char *data;
+	const char *end;
+	unsigned long long offset = sizeof(LogBinaryHeader);
+	unsigned long long since;
+	unsigned int messages = 0;
+	unsigned int length;
+
+	while (offset + sizeof(LogBinaryRecord) <= map->size) {
+		record = (const LogBinaryRecord *)((const char *)map->data + offset);
+		length = record->length;
+
+		// an unfinished record marks the end of the log
+		if (length == 0) {
+			break;
+		}
+		if (length < sizeof(LogBinaryRecord) || length > map->size - offset) {
+			fprintf(stderr, "Corrupt record at offset %llu\n", offset);
+			break;
+		}
+
+		data = (const char *)(record + 1);
+		end = (const char *)record + length;
+		offset += length;
+
+		if (record->type == LOG_RECORD_FORMAT) {
+			if (memchr(data, '\0', end - data) == NULL ||
+					!add_format(record->format_id, data)) {
+				break;
+			}
+			continue;
+		}
+
+		if (timestamps) {
+			since = record->timestamp_ns - header->start_ns;
+			printf("[+%llu.%09llu] ", since / 1000000000ULL,
+				since % 1000000000ULL);
+		}
+		printf("[%s] ", log_level_name(record->level));
+
+		if (record->format_id == LOG_FORMAT_PREFORMATTED) {
+			print_message("%s", data, end);
+		} else if (record->format_id >= format_capacity ||
+				formats[record->format_id] == NULL) {
+			printf("<unknown format %u>", record->format_id);
+		} else if (!print_message(formats[record->format_id], data, end)) {
+			printf("<truncated>");
+		}
+		putchar('\n');
+		messages++;
+	}
+
+	return messages;
+}
+
+int
+main(int argc, char **argv) {
+	const LogBinaryHeader *header;
+	MapFile map;
+	const char *path = NULL;
+	unsigned char timestamps = 0;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-t") == 0) {
+			timestamps = 1;
+		} else {
+			path = argv[i];
+		}
+	}
+
+	if (path == NULL) {
+		fprintf(stderr, "Usage: %s [-t] <binary log>\n", argv[0]);
+		return 1;
+	}
+
+	log_init(LOG_TO_STDOUT, NULL, LOG_LEVEL_ERROR | LOG_LEVEL_SEVERE);
+
+	if (!mapfile_open(&map, path)) {
+		log_close();
+		return 1;
+	}
+
+	header = map.data;
+	if (map.size < sizeof(LogBinaryHeader) ||
+			memcmp(header->magic, LOG_BINARY_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != LOG_BINARY_VERSION) {
+		fprintf(stderr, "%s is not a binary log\n", path);
+		mapfile_close(&map, 0);
+		log_close();
+		return 1;
+	}
+
+	decode(&map, timestamps);
+
+	mapfile_close(&map, 0);
+	free(formats);
+	log_close();
+	return 0;
+}
@@ -1,272 +1,862 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "../log/log.h"
-#include "../misc/stringutils.h"
+#include "../misc/arena.h"
+#include "../misc/epoch.h"
+#include "../misc/filewatch.h"
+#include "../misc/mapfile.h"
+#include "../misc/thread.h"
 
-static int last_handle = 0;
-static Config *configs = NULL;
+/*
+ * Handles hold an index into the handle table in their low
+ * HANDLE_INDEX_BITS bits and the generation of that slot above them. Closing
+ * a config moves its slot on a generation, so a stale handle stops matching
+ * even once the slot is reused. Generations skip 0 so handles stay positive.
+ */
+#define HANDLE_INDEX_BITS	16
+#define HANDLE_INDEX_MASK	((1u << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATIONS	(1u << (31 - HANDLE_INDEX_BITS))
+#define HANDLE_PAGE_SLOTS	256
+#define HANDLE_PAGES		((HANDLE_INDEX_MASK + 1) / HANDLE_PAGE_SLOTS)
+
+struct sConfigSlot {
+	Config *config;				// NULL while the slot is free
+	unsigned int generation;
+	unsigned int next_free;		// index + 1 of the next free slot
+};
+
+typedef struct sConfigSlot ConfigSlot;
 
 /*
- * Retrieves a pointer to the last Config struct in the linked list
+ * The handle table is split into pages which are allocated as they are first
+ * needed and never moved or freed, so handles are resolved without a lock.
+ * Only config_create() and config_close() take table_lock.
  */
+static ConfigSlot *pages[HANDLE_PAGES];
+static unsigned int slots_used;		// slots handed out at least once
+static unsigned int first_free;		// index + 1 of the first free slot
+static unsigned char table_lock;
+
 static
-Config *
-get_last_config() {
-	Config *config;
-	
-	// cycle through all the configs until we come to an empty slot
-	config = configs;
-	while (config->next_config != NULL) {
-		config = (Config *)config->next_config;
+void
+lock_table() {
+	while (__atomic_test_and_set(&table_lock, __ATOMIC_ACQUIRE)) {
+		thread_yield();
 	}
-	
-	return config;
+}
+
+static
+void
+unlock_table() {
+	__atomic_clear(&table_lock, __ATOMIC_RELEASE);
 }
 
 /*
- * Retrieves a pointer to the Config struct directly before the one specified.
- * Returns NULL if not found or the config is the first in the list
+ * Retrieves a pointer to a Config struct with the specified handle
+ * Returns NULL if the handle is not open, including handles of closed configs.
  */
 static
 Config *
-get_config_before(Config *config) {
-	Config *fconfig;	// will hold the found config
-	
-	if (configs == NULL) {
-		log_write(LOG_LEVEL_ERROR, "No Configs found");
+get_config(int handle) {
+	ConfigSlot *page;
+	ConfigSlot *slot;
+	Config *config;
+	unsigned int index;
+	unsigned int generation;
+
+	if (handle <= 0) {
 		return NULL;
 	}
-	
-	if (configs == config) {
-		log_write(LOG_LEVEL_DEBUG, "Config found is first in the list");
+
+	index = (unsigned int)handle & HANDLE_INDEX_MASK;
+	generation = (unsigned int)handle >> HANDLE_INDEX_BITS;
+
+	page = __atomic_load_n(&pages[index / HANDLE_PAGE_SLOTS],
+		__ATOMIC_ACQUIRE);
+	if (page == NULL) {
 		return NULL;
 	}
-	
-	fconfig = configs;
-	while (fconfig->next_config != NULL) {
-		if (fconfig->next_config == config) {
-			return fconfig;
+	slot = &page[index % HANDLE_PAGE_SLOTS];
+
+	if (__atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) != generation) {
+		return NULL;
+	}
+	config = __atomic_load_n(&slot->config, __ATOMIC_ACQUIRE);
+
+	// if the slot was closed and reused in between, the generation has moved
+	if (__atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) != generation) {
+		return NULL;
+	}
+
+	return config;
+}
+
+/*
+ * Places config in a free slot of the handle table and sets its handle.
+ * Returns 1 if a slot was found.
+ */
+static
+unsigned int
+open_slot(Config *config) {
+	ConfigSlot *page;
+	ConfigSlot *slot;
+	unsigned int index;
+
+	lock_table();
+
+	if (first_free != 0) {
+		index = first_free - 1;
+		slot = &pages[index / HANDLE_PAGE_SLOTS][index % HANDLE_PAGE_SLOTS];
+		first_free = slot->next_free;
+	} else {
+		if (slots_used > HANDLE_INDEX_MASK) {
+			unlock_table();
+			return 0;
 		}
-		
-		fconfig = fconfig->next_config;
+
+		index = slots_used;
+		page = pages[index / HANDLE_PAGE_SLOTS];
+		if (page == NULL) {
+			page = calloc(HANDLE_PAGE_SLOTS, sizeof(ConfigSlot));
+			if (page == NULL) {
+				unlock_table();
+				return 0;
+			}
+			__atomic_store_n(&pages[index / HANDLE_PAGE_SLOTS], page,
+				__ATOMIC_RELEASE);
+		}
+
+		slot = &page[index % HANDLE_PAGE_SLOTS];
+		__atomic_store_n(&slot->generation, 1, __ATOMIC_RELEASE);
+		slots_used++;
 	}
-	
-	return NULL;
+
+	config->handle = (int)(slot->generation << HANDLE_INDEX_BITS | index);
+	__atomic_store_n(&slot->config, config, __ATOMIC_RELEASE);
+
+	unlock_table();
+	return 1;
+}
+
+/*
+ * Empties the slot holding config and moves it on a generation so its handle
+ * no longer resolves, then puts it back on the free list.
+ * Returns 1 if the slot was emptied, or 0 if another call got there first.
+ */
+static
+unsigned int
+close_slot(Config *config) {
+	ConfigSlot *slot;
+	unsigned int index;
+	unsigned int generation;
+
+	index = (unsigned int)config->handle & HANDLE_INDEX_MASK;
+
+	lock_table();
+
+	slot = &pages[index / HANDLE_PAGE_SLOTS][index % HANDLE_PAGE_SLOTS];
+	if (slot->config != config) {
+		unlock_table();
+		return 0;
+	}
+	__atomic_store_n(&slot->config, NULL, __ATOMIC_RELEASE);
+
+	generation = slot->generation + 1;
+	if (generation == HANDLE_GENERATIONS) {
+		generation = 1;
+	}
+	__atomic_store_n(&slot->generation, generation, __ATOMIC_RELEASE);
+
+	slot->next_free = first_free;
+	first_free = index + 1;
+
+	unlock_table();
+	return 1;
+}
+
+/*
+ * Hashes a key with FNV-1a, finding its length and packing short keys into a
+ * word on the same pass.
+ * Returns the hash.
+ */
+static
+unsigned int
+hash_key(const char *key, unsigned int *length,
+			unsigned long long *short_key) {
+	unsigned int hash = 2166136261u;
+	unsigned long long packed = 0;
+	unsigned int i;
+
+	for (i = 0; key[i] != '\0'; i++) {
+		hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+		if (i < CONFIG_SHORT_KEY) {
+			packed |= (unsigned long long)(unsigned char)key[i] << (i * 8);
+		}
+	}
+
+	*length = i;
+	*short_key = i <= CONFIG_SHORT_KEY ? packed : 0;
+	return hash;
+}
+
+/*
+ * Finds the index slot holding key, or the free slot it would go in.
+ * Returns a pointer to the slot.
+ * Note: The index must have at least one free slot.
+ */
+static
+Pair **
+find_slot(ConfigIndex *index, const char *key, unsigned int hash,
+			unsigned int length, unsigned long long short_key) {
+	Pair *pair;
+	unsigned int mask = index->size - 1;
+	unsigned int slot;
+
+	// linear probing until a match or a free slot
+	slot = hash & mask;
+	while ((pair = __atomic_load_n(&index->slots[slot], __ATOMIC_ACQUIRE)) !=
+			NULL) {
+		if (pair->hash == hash && pair->key_length == length) {
+			// short keys are settled by the packed word alone
+			if (length <= CONFIG_SHORT_KEY) {
+				if (pair->short_key == short_key) {
+					break;
+				}
+			} else if (memcmp(pair->key, key, length) == 0) {
+				break;
+			}
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return &index->slots[slot];
 }
 
-/* 
- * Retrieves a pointer to the last pair for the supplied Config struct
- * If no pairs have been created yet we return NULL.
+/*
+ * Returns the pair in the snapshot with the same key as the specified pair,
+ * or NULL.
  */
 static
 Pair *
-get_last_pair(Config *config) {
+find_matching(ConfigSnapshot *snapshot, Pair *pair) {
+	if (snapshot->index == NULL) {
+		return NULL;
+	}
+
+	return *find_slot(snapshot->index, pair->key, pair->hash,
+		pair->key_length, pair->short_key);
+}
+
+/*
+ * Makes sure the index has room for one more pair, doubling it once it would
+ * pass three quarters full. Readers may still be probing the old index, so
+ * once the snapshot is published the old one is retired rather than freed.
+ * Returns 1 if there is room.
+ */
+static
+unsigned int
+reserve_slot(ConfigSnapshot *snapshot) {
+	ConfigIndex *index;
+	ConfigIndex *old_index = snapshot->index;
+	Pair *pair;
+	unsigned int size;
+	unsigned int slot;
+
+	if (old_index != NULL &&
+			(snapshot->pair_count + 1) * 4 <= old_index->size * 3) {
+		return 1;
+	}
+
+	size = old_index == NULL ? CONFIG_INDEX_SIZE : old_index->size * 2;
+	index = calloc(1, sizeof(ConfigIndex) + size * sizeof(Pair *));
+	if (index == NULL) {
+		return 0;
+	}
+	index->size = size;
+
+	// the keys are all distinct, so each pair only needs a free slot
+	for (pair = snapshot->first_pair; pair != NULL; pair = pair->next_pair) {
+		slot = pair->hash & (size - 1);
+		while (index->slots[slot] != NULL) {
+			slot = (slot + 1) & (size - 1);
+		}
+		index->slots[slot] = pair;
+	}
+
+	__atomic_store_n(&snapshot->index, index, __ATOMIC_RELEASE);
+
+	if (old_index != NULL) {
+		if (snapshot->published) {
+			epoch_retire(old_index, free);
+		} else {
+			free(old_index);
+		}
+	}
+	return 1;
+}
+
+/*
+ * Copies a replacement value outside the arena, so that it can be freed in
+ * turn when it is replaced again.
+ * Returns the copy or NULL if there is no memory.
+ */
+static
+char *
+copy_value(const char *value, unsigned int value_length) {
+	char *copy;
+
+	copy = malloc(value_length + 1);
+	if (copy != NULL) {
+		memcpy(copy, value, value_length);
+		copy[value_length] = '\0';
+	}
+
+	return copy;
+}
+
+/*
+ * Stores a pair in the snapshot, replacing the value if the key is already
+ * set. copy makes the pair take copies of key and value in the snapshot's
+ * arena. Otherwise it points at them directly, which is how config_load()
+ * keeps pairs in the file text.
+ * Each pair is filled in before it is linked in, so lookups can run
+ * alongside.
+ * A copied replacement value is allocated on its own, and the value it
+ * replaces is freed once no reader can hold it, so setting the same key over
+ * and over doesn't grow the arena.
+ * Returns CONFIG_SUCCESS or CONFIG_FAILED.
+ */
+static
+int
+store_pair(ConfigSnapshot *snapshot, char *key, char *value,
+			unsigned int value_length, unsigned char copy) {
 	Pair *pair;
+	Pair **slot;
+	char *new_value;
+	char *old_value;
+	unsigned long long short_key;
+	unsigned int length;
+	unsigned int hash;
+	
+	if (!reserve_slot(snapshot)) {
+		log_write(LOG_LEVEL_ERROR, "Failed to allocate mem for pair index");
+		return CONFIG_FAILED;
+	}
 	
-	pair = config->first_pair;
+	hash = hash_key(key, &length, &short_key);
+	slot = find_slot(snapshot->index, key, hash, length, short_key);
+	
+	if (!copy) {
+		new_value = value;
+	} else if (*slot != NULL) {
+		new_value = copy_value(value, value_length);
+	} else {
+		new_value = arena_copy_string(&snapshot->arena, value, value_length);
+	}
+	if (new_value == NULL) {
+		log_write(LOG_LEVEL_ERROR, "Failed to allocate mem for pair");
+		return CONFIG_FAILED;
+	}
+	
+	// an existing key keeps its place in the list and takes the new value
+	if (*slot != NULL) {
+		pair = *slot;
+		old_value = pair->value;
+		pair->value_length = value_length;
+		__atomic_store_n(&pair->value, new_value, __ATOMIC_RELEASE);
+		
+		// readers may still be looking at the old value
+		if (pair->value_owned) {
+			if (snapshot->published) {
+				epoch_retire(old_value, free);
+			} else {
+				free(old_value);
+			}
+		}
+		pair->value_owned = copy;
+		
+		LOG_DEBUG("Pair updated %s = %s", key, value);
+		return CONFIG_SUCCESS;
+	}
+	
+	pair = arena_alloc(&snapshot->arena, sizeof(Pair));
 	if (pair == NULL) {
-		return NULL;
+		log_write(LOG_LEVEL_ERROR, "Failed to allocate mem for pair");
+		LOG_DEBUG("key=%s, value=%s", key, value);
+		return CONFIG_FAILED;
 	}
+	memset(pair, '\0', sizeof(Pair));
 	
-	// cycle through all the pairs until we come to an empty slot
-	while (pair->next_pair != NULL) {
-		pair = pair->next_pair;
+	pair->key = copy ? arena_copy_string(&snapshot->arena, key, length) : key;
+	if (pair->key == NULL) {
+		log_write(LOG_LEVEL_ERROR, "Failed to allocate mem for pair");
+		return CONFIG_FAILED;
 	}
+	pair->value = new_value;
+	pair->hash = hash;
+	pair->key_length = length;
+	pair->value_length = value_length;
+	pair->short_key = short_key;
+	
+	// append to the list so the file order is kept for config_save()
+	if (snapshot->last_pair == NULL) {
+		LOG_DEBUG("No pairs have been created yet. " \
+			"Starting from the first");
+		__atomic_store_n(&snapshot->first_pair, pair, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&snapshot->last_pair->next_pair, pair,
+			__ATOMIC_RELEASE);
+	}
+	snapshot->last_pair = pair;
+	
+	__atomic_store_n(slot, pair, __ATOMIC_RELEASE);
+	snapshot->pair_count++;
+	
+	LOG_DEBUG("Pair set %s = %s", key, value);
 	
-	return pair;
+	return CONFIG_SUCCESS;
 }
 
 /*
- * Retrieves a pointer to a Config struct with the specified handle
+ * Returns a new, empty snapshot or NULL if there is no memory.
  */
 static
-Config *
-get_config(int handle) {
-	Config *config;
-	if (configs == NULL) {
+ConfigSnapshot *
+create_snapshot() {
+	ConfigSnapshot *snapshot;
+	
+	snapshot = malloc(sizeof(ConfigSnapshot));
+	if (snapshot == NULL) {
+		log_write(LOG_LEVEL_ERROR, "Failed to allocate mem for config");
 		return NULL;
 	}
+	memset(snapshot, '\0', sizeof(ConfigSnapshot));
+	arena_init(&snapshot->arena);
 	
-	config = configs;
-	if (config->handle == handle) {
-		return config;
-	}
+	return snapshot;
+}
+
+/*
+ * Frees a snapshot along with its pairs. Takes a void pointer so it can be
+ * handed to epoch_retire().
+ */
+static
+void
+free_snapshot(void *item) {
+	ConfigSnapshot *snapshot = item;
+	Pair *pair;
 	
-	while(config->next_config != NULL) {
-		config = config->next_config;
-		if (config->handle == handle) {
-			return config;
+	// pairs, keys, first values and the file text all live in the arena
+	for (pair = snapshot->first_pair; pair != NULL; pair = pair->next_pair) {
+		if (pair->value_owned) {
+			free(pair->value);
 		}
 	}
-	
-	return NULL;
+	arena_free(&snapshot->arena);
+	free(snapshot->index);
+	free(snapshot);
 }
 
 int 
 config_set(int handle, char *key, char *value) {
 	Config *config;
-	Pair *pair;
+	int result;
 	
+	// config_close() waits for callers before freeing the config
+	epoch_enter();
 	config = get_config(handle);
 	if (config == NULL) {
+		epoch_exit();
 		log_write(LOG_LEVEL_ERROR, "Unable to set pair. " \
 			"Config handle %d not found", handle);
 		return CONFIG_INVALID_HANDLE;
 	}
 	
-	// get the last used pair in the config. NULL indicates that we need to
-	// allocate for the first pair in the list.
-	pair = get_last_pair(config);
-	if (pair == NULL) {
-		log_write(LOG_LEVEL_DEBUG, "No pairs have been created yet. " \
-			"Starting from the first");
-		pair = malloc(sizeof(Pair));
-		memset(pair, '\0', sizeof(Pair));
-		config->first_pair = pair;
-	} else {
-		pair->next_pair = malloc(sizeof(Pair));
-		memset(pair->next_pair, '\0', sizeof(Pair));
-		pair = pair->next_pair;
-	}
-	
-	if (pair == NULL) {
-		log_write(LOG_LEVEL_ERROR, "Failed to allocate mem for pair");
-		log_write(LOG_LEVEL_DEBUG, "handle=%d, key=%s, value=%s", handle, 
-			key, value);
-		return CONFIG_FAILED;
+	// a reload would drop the value and report it as a change, so watched
+	// snapshots are left alone
+	mutex_lock(&config->lock);
+	if (config->watch != NULL) {
+		mutex_unlock(&config->lock);
+		epoch_exit();
+		log_write(LOG_LEVEL_ERROR, "Unable to set pair. " \
+			"Config %d is watched", handle);
+		return CONFIG_WATCHED;
 	}
+	result = store_pair(config->snapshot, key, value, strlen(value), 1);
+	mutex_unlock(&config->lock);
+	epoch_exit();
 	
-	pair->key = malloc(strlen(key) + 1);
-	strcpy(pair->key, key);
-	pair->value = malloc(strlen(value) + 1);
-	strcpy(pair->value, value);
-	
-	log_write(LOG_LEVEL_DEBUG, "Pair set %s = %s", key, value);
+	// clear out any index the pair outgrew or value it replaced
+	epoch_reclaim();
 	
-	return CONFIG_SUCCESS;
+	return result;
 }
 
 char *
 config_get(int handle, char *key) {
 	Config *config;
-	Pair *pair;
-	
+	ConfigSnapshot *snapshot;
+	ConfigIndex *index;
+	Pair *pair = NULL;
+	char *value = NULL;
+	unsigned long long short_key;
+	unsigned int length;
+	unsigned int hash;
+	
+	hash = hash_key(key, &length, &short_key);
+	
+	// config_close() waits for readers before freeing the config
+	epoch_enter();
 	config = get_config(handle);
 	if (config == NULL) {
+		epoch_exit();
 		log_write(LOG_LEVEL_ERROR, "Unable to get value. " \
 			"Config handle %d not found", handle);
 		return NULL;
 	}
-
-	if (config->first_pair == NULL) {
+	
+	snapshot = __atomic_load_n(&config->snapshot, __ATOMIC_ACQUIRE);
+	index = __atomic_load_n(&snapshot->index, __ATOMIC_ACQUIRE);
+	if (index != NULL) {
+		pair = *find_slot(index, key, hash, length, short_key);
+		if (pair != NULL) {
+			value = __atomic_load_n(&pair->value, __ATOMIC_ACQUIRE);
+		}
+	}
+	epoch_exit();
+	
+	if (index == NULL) {
 		log_write(LOG_LEVEL_ERROR, "Unable to get value with key '%s'. " \
 			"No pairs defined", key);
+	} else if (pair == NULL) {
+		log_write(LOG_LEVEL_ERROR, "No pair found for key '%s'", key);
+	}
+	
+	return value;
+}
+
+void
+config_read_begin() {
+	epoch_enter();
+}
+
+void
+config_read_end() {
+	epoch_exit();
+}
+
+/*
+ * Returns 1 for the whitespace that separates a key from its value.
+ */
+static
+unsigned int
+is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/*
+ * Loads the pairs in a config file into an unpublished snapshot. The file is
+ * mapped and copied once into the snapshot's arena, then split into keys and
+ * values in a single pass. Each token is terminated in place and the pairs
+ * point straight at them, so lines and tokens can be any length.
+ * Every non-blank line must hold a key and a value separated by whitespace.
+ * Anything after the value is ignored.
+ */
+static
+int 
+load_pairs(ConfigSnapshot *snapshot, const char *filename) {
+	MapFile map;
+	struct stat info;
+	char *text;
+	char *end;
+	char *p;
+	char *key;
+	char *value;
+	unsigned int line;
+	unsigned int key_length;
+	unsigned int value_length;
+	int result = CONFIG_SUCCESS;
+	
+	if (stat(filename, &info) != 0) {
+		return CONFIG_NOT_FOUND;
+	}
+	
+	// an empty file can't be mapped but is a valid config
+	if (info.st_size == 0) {
+		return CONFIG_SUCCESS;
+	}
+	
+	if (!mapfile_open(&map, filename)) {
+		return CONFIG_NOT_FOUND;
 	}
 	
-	pair = config->first_pair;
-	// check the first pair
-	if (strcmp(pair->key, key) == 0) {
-		return pair->value;
+	// the extra byte terminates a value that runs to the end of the file
+	text = arena_alloc(&snapshot->arena, map.size + 1);
+	if (text == NULL) {
+		log_write(LOG_LEVEL_ERROR, "Failed to allocate mem for config " \
+			"file (%s)", filename);
+		mapfile_close(&map, 0);
+		return CONFIG_FAILED;
+	}
+	memcpy(text, map.data, map.size);
+	text[map.size] = '\0';
+	end = text + map.size;
+	mapfile_close(&map, 0);
+	
+	p = text;
+	for (line = 1; p < end; line++, p++) {
+		while (p < end && is_blank(*p)) {
+			p++;
+		}
+		if (p == end || *p == '\n') {
+			continue;
+		}
+		
+		key = p;
+		while (p < end && *p != '\n' && !is_blank(*p)) {
+			p++;
+		}
+		key_length = p - key;
+		
+		while (p < end && is_blank(*p)) {
+			p++;
+		}
+		if (p == end || *p == '\n') {
+			log_write(LOG_LEVEL_ERROR, "Malformed config file at line %u:\n"
+						"\t%.*s", line, key_length, key);
+			result = CONFIG_INVALID;
+			break;
+		}
+		
+		value = p;
+		while (p < end && *p != '\n' && !is_blank(*p)) {
+			p++;
+		}
+		value_length = p - value;
+		
+		while (p < end && *p != '\n') {
+			p++;
+		}
+		
+		// the byte after each token is whitespace, a newline or the spare
+		// byte at the end, so it can take the terminator
+		key[key_length] = '\0';
+		value[value_length] = '\0';
+		
+		LOG_DEBUG("Found pair at line %u: %s = %s", line, key, value);
+		if (store_pair(snapshot, key, value, value_length, 0) !=
+				CONFIG_SUCCESS) {
+			log_write(LOG_LEVEL_SEVERE, "Failed to set config for " \
+				"key: %s", key);
+			result = CONFIG_INVALID;
+			break;
+		}
 	}
 	
-	// check all subsequent pairs
-	while (pair->next_pair != NULL) {
-		pair = pair->next_pair;
-		if (strcmp(pair->key, key) == 0) {
-			return pair->value;
+	return result;
+}
+
+/*
+ * Adds each key of from that is missing from to to keys. Unless missing_only
+ * is set, keys that hold a different value in to are added too.
+ * Returns the new number of keys.
+ */
+static
+unsigned int
+diff_keys(ConfigSnapshot *from, ConfigSnapshot *to, char **keys,
+			unsigned int count, unsigned char missing_only) {
+	Pair *pair;
+	Pair *match;
+	
+	for (pair = from->first_pair; pair != NULL; pair = pair->next_pair) {
+		match = find_matching(to, pair);
+		if (match == NULL || (!missing_only &&
+				(match->value_length != pair->value_length ||
+				memcmp(match->value, pair->value, pair->value_length) != 0))) {
+			keys[count++] = pair->key;
 		}
 	}
 	
-	log_write(LOG_LEVEL_ERROR, "No pair found for key '%s'", key);
-	return NULL;
+	return count;
 }
 
 /*
- * Opens a config file for processing.
- * handle as returned by a call to config_create()
- * Note: Expects the Config struct to already have the file name populated.
+ * Reloads a watched config after its file changed. The new file is parsed
+ * into its own snapshot, compared with the current one and only swapped in
+ * if something changed.
  */
 static
-int 
-open(int handle) {
-	FILE *fp;
+void
+reload(void *arg) {
+	Config *config = arg;
+	ConfigSnapshot *snapshot;
+	ConfigSnapshot *old_snapshot;
+	char **keys;
+	unsigned int count;
+	
+	snapshot = create_snapshot();
+	if (snapshot == NULL) {
+		return;
+	}
+	
+	if (load_pairs(snapshot, config->filename) != CONFIG_SUCCESS) {
+		log_write(LOG_LEVEL_WARN, "Config file %s changed but could not be " \
+			"loaded. Keeping the current values.", config->filename);
+		free_snapshot(snapshot);
+		return;
+	}
+	
+	// held until the callback returns, so the old keys it is given stay put
+	epoch_enter();
+	mutex_lock(&config->lock);
+	old_snapshot = config->snapshot;
+	
+	// each key is listed once, from whichever snapshot has it
+	keys = malloc(sizeof(char *) * ((unsigned long long)snapshot->pair_count +
+		old_snapshot->pair_count + 1));
+	if (keys == NULL) {
+		log_write(LOG_LEVEL_ERROR, "Failed to allocate mem for changed keys");
+		mutex_unlock(&config->lock);
+		epoch_exit();
+		free_snapshot(snapshot);
+		return;
+	}
+	
+	count = diff_keys(snapshot, old_snapshot, keys, 0, 0);
+	count = diff_keys(old_snapshot, snapshot, keys, count, 1);
+	
+	if (count == 0) {
+		mutex_unlock(&config->lock);
+		epoch_exit();
+		free(keys);
+		free_snapshot(snapshot);
+		return;
+	}
+	
+	snapshot->published = 1;
+	__atomic_store_n(&config->snapshot, snapshot, __ATOMIC_SEQ_CST);
+	mutex_unlock(&config->lock);
+	epoch_retire(old_snapshot, free_snapshot);
+	
+	log_write(LOG_LEVEL_INFO, "Config file %s reloaded (%u keys changed)",
+		config->filename, count);
+	
+	if (config->changed != NULL) {
+		config->changed(config->handle, count, keys);
+	}
+	
+	free(keys);
+	epoch_exit();
+	epoch_reclaim();
+}
+
+int
+config_watch(int handle, ptrConfigChanged changed) {
 	Config *config;
-	int line;
-	char str[255];
-	char key[50], value[50];
-	int result = CONFIG_SUCCESS;
+	FileWatch *watch;
 	
+	epoch_enter();
 	config = get_config(handle);
 	if (config == NULL) {
-		log_write(LOG_LEVEL_DEBUG, "Config struct not found: %d. " \
-			"Has it been created yet? config_create()", handle);
-		return ;
+		epoch_exit();
+		log_write(LOG_LEVEL_ERROR, "Unable to watch config. " \
+			"Config handle %d not found", handle);
+		return CONFIG_INVALID_HANDLE;
 	}
 	
-	fp = fopen(config->filename, "r");
+	if (config->filename == NULL) {
+		epoch_exit();
+		log_write(LOG_LEVEL_ERROR, "Unable to watch config. " \
+			"File name has not been set");
+		return CONFIG_FAILED;
+	}
 	
-	if (fp == NULL) {
-		return CONFIG_NOT_FOUND;
+	if (config->watch != NULL) {
+		config_unwatch(handle);
 	}
 	
-	line = 1;
-	while (!feof(fp)) {
-		str[0] = '\0';
-		fgets(str, sizeof(str), fp);
-		if (strlen(trim_whitespace(str)) > 0) {
-			if (sscanf(str, "%s %s", key, value) != 2) {
-				log_write(LOG_LEVEL_ERROR, "Malformed config file at line %d:\n"
-							"\t%s", line, trim_whitespace(str));
-							
-				result = CONFIG_INVALID;
-				break;
-			} else {
-				log_write(LOG_LEVEL_DEBUG, "Found pair at line %d: %s = %s", 
-					line, key, value);
-				if (config_set(handle, key, value) != CONFIG_SUCCESS) {
-					log_write(LOG_LEVEL_SEVERE, "Failed to set config for " \
-						"key: %s", key);
-					result = CONFIG_INVALID;
-					break;
-				}
-			}
-		}
-				
-		line++;
+	config->changed = changed;
+	watch = filewatch_start(config->filename, reload, config);
+	
+	// config_set() checks for the watch under the lock
+	mutex_lock(&config->lock);
+	config->watch = watch;
+	mutex_unlock(&config->lock);
+	epoch_exit();
+	
+	return watch == NULL ? CONFIG_FAILED : CONFIG_SUCCESS;
+}
+
+int
+config_unwatch(int handle) {
+	Config *config;
+	FileWatch *watch;
+	
+	epoch_enter();
+	config = get_config(handle);
+	if (config == NULL) {
+		epoch_exit();
+		log_write(LOG_LEVEL_ERROR, "Unable to unwatch config. " \
+			"Config handle %d not found", handle);
+		return CONFIG_INVALID_HANDLE;
 	}
 	
-	fclose(fp);
+	// stopped outside the lock, as a reload in progress takes it
+	mutex_lock(&config->lock);
+	watch = config->watch;
+	config->watch = NULL;
+	mutex_unlock(&config->lock);
 	
-	return result;
+	if (watch != NULL) {
+		filewatch_stop(watch);
+	}
+	epoch_exit();
+	
+	return CONFIG_SUCCESS;
 }
 
 void 
 config_set_filename(int handle, char *filename) {
 	Config *config;
 	
+	epoch_enter();
 	config = get_config(handle);
 	if (config != NULL) {
 		config->filename = malloc(strlen(filename) + 1);
 		strcpy(config->filename, filename);
 	}
+	epoch_exit();
 }
 
 int 
 config_load(char *filename) {
+	Config *config;
 	int handle;
 	int result;
 	
 	// setup an empty config
 	handle = config_create();
+	if (handle < 0) {
+		return handle;
+	}
 	config_set_filename(handle, filename);
-	result = open(handle);
+	config = get_config(handle);
+	
+	// nobody else has the handle yet, so the index needn't be retired as it
+	// grows
+	config->snapshot->published = 0;
+	result = load_pairs(config->snapshot, filename);
+	config->snapshot->published = 1;
 	
 	if (result == CONFIG_SUCCESS) {
 		return handle;
 	} else {
+		// the caller never sees the handle, so don't leave it open
+		config_close(handle);
 		return result;
 	}
 }
@@ -274,18 +864,29 @@ config_load(char *filename) {
 int 
 config_create() {
 	Config *new_config = NULL;
-	Config *last_config;
 	
 	new_config = malloc(sizeof(Config));
+	if (new_config == NULL) {
+		log_write(LOG_LEVEL_ERROR, "Failed to allocate mem for config");
+		return CONFIG_FAILED;
+	}
 	memset(new_config, '\0', sizeof(Config));
 	
-	new_config->handle = ++last_handle;
-	
-	if (configs == NULL) {
-		configs = new_config;
-	} else {
-		last_config = get_last_config();
-		last_config->next_config = new_config;
+	new_config->snapshot = create_snapshot();
+	if (new_config->snapshot == NULL) {
+		free(new_config);
+		return CONFIG_FAILED;
+	}
+	new_config->snapshot->published = 1;
+	mutex_init(&new_config->lock);
+	
+	if (!open_slot(new_config)) {
+		log_write(LOG_LEVEL_ERROR, "Unable to create config. " \
+			"No handles are free");
+		mutex_destroy(&new_config->lock);
+		free_snapshot(new_config->snapshot);
+		free(new_config);
+		return CONFIG_FAILED;
 	}
 	
 	return new_config->handle;
@@ -294,81 +895,104 @@ config_create() {
 int
 config_close(int handle) {
 	Config *config;
-	Pair *pair;
-	Pair *next_pair;
-	int pair_count = 0;
 
-	log_write(LOG_LEVEL_DEBUG, "Closing config %d...", handle);
+	LOG_DEBUG("Closing config %d...", handle);
+	
+	// stop the handle resolving before anything is freed. Only one of several
+	// racing closes gets to empty the slot.
+	epoch_enter();
 	config = get_config(handle);
-	if (config == NULL) {
+	if (config == NULL || !close_slot(config)) {
+		epoch_exit();
 		log_write(LOG_LEVEL_ERROR, "Unable close config. " \
 			"Config handle %d not found", handle);
 		return CONFIG_INVALID_HANDLE;
 	}
+	epoch_exit();
 	
-	// free all pairs' resources
-	if (config->first_pair != NULL) {
-		pair = config->first_pair;
-		
-		// free starting pair
-		free(pair->key);
-		free(pair->value);
-		free(pair);
-		
-		pair_count++;
-		
-		// free remainging pairs
-		while(pair->next_pair != NULL) {
-			pair = pair->next_pair;
-			
-			free(pair->key);
-			free(pair->value);
-			free(pair);
-			pair_count++;
-		}
-		
-		config->first_pair = NULL;
+	// calls and readers that found the config before its handle closed may
+	// still be using it, and may even have started a watch
+	epoch_synchronize();
+	
+	// no reloads once we start tearing down
+	if (config->watch != NULL) {
+		filewatch_stop(config->watch);
+		config->watch = NULL;
 	}
 	
+	LOG_DEBUG("Config closed (%u pairs freed from %u blocks)",
+		config->snapshot->pair_count, config->snapshot->arena.block_count);
+	
+	// nothing can reach the snapshot any more
+	free_snapshot(config->snapshot);
+	
+	mutex_destroy(&config->lock);
 	free(config->filename);
+	free(config);
 	
-	// If this config is the first, we need to get the next in the list and 
-	// move it to the front.
-	if (configs == config && config->next_config != NULL) {
-		log_write(LOG_LEVEL_DEBUG, "Config was first in list. Shifting " \
-			"remaining configs up one slot.");
-		configs = config->next_config;
-	} else {
-		// fill in the link between configs
-		get_config_before(config)->next_config == config->next_config;
+	return CONFIG_SUCCESS;
+}
+
+int
+config_get_stats(int handle, ConfigStats *stats) {
+	Config *config;
+	ConfigSnapshot *snapshot;
+	ConfigIndex *index;
+	
+	epoch_enter();
+	config = get_config(handle);
+	if (config == NULL) {
+		epoch_exit();
+		log_write(LOG_LEVEL_ERROR, "Unable to get config stats. " \
+			"Config handle %d not found", handle);
+		return CONFIG_INVALID_HANDLE;
 	}
 	
-	free(config);
+	// config_set() may be moving the counts on, so they are only a snapshot
+	snapshot = __atomic_load_n(&config->snapshot, __ATOMIC_ACQUIRE);
+	index = __atomic_load_n(&snapshot->index, __ATOMIC_ACQUIRE);
+	stats->pairs = snapshot->pair_count;
+	stats->arena_blocks = snapshot->arena.block_count;
+	stats->arena_reserved = snapshot->arena.reserved;
+	stats->arena_used = snapshot->arena.used;
+	stats->index_bytes = index == NULL ? 0 : sizeof(ConfigIndex) +
+		(unsigned long long)index->size * sizeof(Pair *);
+	epoch_exit();
 	
-	log_write(LOG_LEVEL_DEBUG, "Config closed (%d pairs freed)", pair_count);
+	return CONFIG_SUCCESS;
 }
 
 int
 config_save(int handle) {
 	Config *config;
+	ConfigSnapshot *snapshot;
 	Pair *pair;
 	FILE *fp;
 
-	log_write(LOG_LEVEL_DEBUG, "Saving config %d...", handle);
+	LOG_DEBUG("Saving config %d...", handle);
+	epoch_enter();
 	config = get_config(handle);
 	if (config == NULL) {
+		epoch_exit();
 		log_write(LOG_LEVEL_ERROR, "Unable to save config. " \
 			"Config handle %d not found", handle);
 		return CONFIG_INVALID_HANDLE;
 	}
 	
 	if (config->filename == NULL) {
+		epoch_exit();
 		log_write(LOG_LEVEL_ERROR, "Unable to save config. " \
 			"File name has not been set");
 		return CONFIG_FAILED;
 	}
 	
-	if (config->first_pair == NULL) {
+	// the lock keeps config_set() from adding pairs under us
+	mutex_lock(&config->lock);
+	snapshot = config->snapshot;
+	
+	if (snapshot->first_pair == NULL) {
+		mutex_unlock(&config->lock);
+		epoch_exit();
 		log_write(LOG_LEVEL_INFO, "Nothing to write to config. " \
 			"No pairs found");
 		return CONFIG_SUCCESS;
@@ -378,22 +1002,21 @@ config_save(int handle) {
 	fp = fopen(config->filename, "w");
 	
 	if (fp == NULL) {
+		mutex_unlock(&config->lock);
+		epoch_exit();
 		log_write(LOG_LEVEL_ERROR, "Unable to save config. " \
 			"File could not be opened for writing (%s)", config->filename);
 		return CONFIG_FAILED;
 	}
 	
 	// write pair data to file
-	pair = config->first_pair;
-	fprintf(fp, "%s %s\n", pair->key, pair->value);
-	while (pair->next_pair != NULL) {
-		pair = pair->next_pair;
+	for (pair = snapshot->first_pair; pair != NULL; pair = pair->next_pair) {
 		fprintf(fp, "%s %s\n", pair->key, pair->value);
 	}
 	
 	fclose(fp);
+	mutex_unlock(&config->lock);
+	epoch_exit();
 	
 	return CONFIG_SUCCESS;
 }
-
-
@@ -1,6 +1,10 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include "../misc/arena.h"
+#include "../misc/filewatch.h"
+#include "../misc/thread.h"
+
 #define CONFIG_SUCCESS			1
 
 #define CONFIG_FAILED			-1
@@ -9,35 +13,101 @@
 #define CONFIG_STRUCT_MISSING 	-4
 
 #define CONFIG_INVALID_HANDLE	-5
+#define CONFIG_WATCHED			-6
+
+/*
+ * Each Config indexes its pairs in an open addressing hash table which starts
+ * with CONFIG_INDEX_SIZE slots and doubles once it is three quarters full.
+ */
+#define CONFIG_INDEX_SIZE		64
+
+/*
+ * Keys of up to CONFIG_SHORT_KEY bytes are also packed into a single word so
+ * lookups can compare them without reading the key string.
+ */
+#define CONFIG_SHORT_KEY		8
 
 struct sPair {
 	char *key;
 	char *value;
+	unsigned int hash;
+	unsigned int key_length;
+	unsigned int value_length;
+	unsigned long long short_key;	// packed key, 0 if the key is longer
+	unsigned char value_owned;		// value was malloc'd by a replacement
 	struct sPair *next_pair;
 };
 
+struct sConfigIndex {
+	unsigned int size;				// always a power of two
+	struct sPair *slots[];			// pairs by hash, free slots are NULL
+};
+
+/*
+ * The pairs of a config. When a watched file changes a new snapshot is loaded
+ * and swapped in whole, so a reader sees either every old value or every new
+ * one. Snapshots that have been swapped out are freed once no reader can
+ * still be using them.
+ */
+struct sConfigSnapshot {
+	Arena arena;					// holds the pairs and their strings
+	struct sPair *first_pair;
+	struct sPair *last_pair;
+	struct sConfigIndex *index;
+	unsigned int pair_count;
+	unsigned char published;		// readers may be looking at it
+};
+
+/*
+ * Called after a watched config has reloaded. keys lists the count keys that
+ * were added, removed or given a new value. The list is only valid for the
+ * length of the call.
+ * Note: The callback runs on the watch thread. It must not close or unwatch
+ *		the config.
+ */
+typedef void (*ptrConfigChanged)(int handle, unsigned int count, char **keys);
+
 struct sConfig {
 	int handle;
 	char *filename;
-	struct sPair *first_pair;
-	struct sConfig *next_config;
+	struct sConfigSnapshot *snapshot;
+	Mutex lock;						// serialises changes to the pairs
+	FileWatch *watch;
+	ptrConfigChanged changed;
 };
 
 typedef struct sConfig Config;
 typedef struct sPair Pair;
+typedef struct sConfigIndex ConfigIndex;
+typedef struct sConfigSnapshot ConfigSnapshot;
+
+struct sConfigStats {
+	unsigned int pairs;
+	unsigned int arena_blocks;			// blocks allocated by the arena
+	unsigned long long arena_reserved;	// bytes held by those blocks
+	unsigned long long arena_used;		// bytes taken by pairs and strings
+	unsigned long long index_bytes;		// size of the key index
+};
+
+typedef struct sConfigStats ConfigStats;
 
 /*
  * Loads a config file and returns the unique handle to that config.
  * filename takes the full path to the config file
+ * Each non-blank line holds a key and a value separated by whitespace. Lines
+ * and values may be any length. If a key appears twice the last value wins.
  * Possible error return codes are:
  *		CONFIG_NOT_FOUND
  * 		CONFIG_INVALID
+ *		CONFIG_FAILED
  */
 int config_load(char *filename);
 
 /*
  * Frees resources associated with the specified Config handle.
  * All configs should be explicitly closed once they are no longer required.
+ * Note: Waits for readers still using the config's values, so it must not be
+ *		called between config_read_begin() and config_read_end().
  */
 int config_close(int handle);
 
@@ -45,14 +115,55 @@ int config_close(int handle);
  * Retrieves the pair value for the specified Config struct based on the
  * supplied key.
  * Returns a null terminated string containing the value.
+ * Lookups take no locks and may run alongside config_set() and reloads.
+ * The value stays valid until the config is closed, unless the config is
+ * watched: a reload frees the old values once no reader can be using them,
+ * so callers of a watched config hold values between config_read_begin()
+ * and config_read_end().
  */
 char *config_get(int handle, char *key);
 
+/*
+ * Marks the calling thread as reading configs. Values returned by
+ * config_get() stay valid until the matching config_read_end(), even if
+ * their config reloads in the meantime. Calls may be nested.
+ * Note: Sections should be short, as old snapshots are held until they end.
+ */
+void config_read_begin();
+
+void config_read_end();
+
+/*
+ * Reloads the config from its file whenever the file changes. The new file
+ * is parsed in full before it replaces anything, so a file that fails to
+ * parse leaves the current values in place. Values stored with config_set()
+ * before the watch started are replaced by the file's on reload, and
+ * config_set() is refused until the config is unwatched.
+ * changed is optional and is called after each reload that changes a value.
+ * Returns CONFIG_SUCCESS if the call is successful
+ * Possible error return codes are:
+ * 		CONFIG_INVALID_HANDLE
+ * 		CONFIG_FAILED
+ */
+int config_watch(int handle, ptrConfigChanged changed);
+
+/*
+ * Stops watching the config's file. config_close() does this itself.
+ * Returns CONFIG_SUCCESS if the call is successful
+ * Possible error return codes are:
+ * 		CONFIG_INVALID_HANDLE
+ */
+int config_unwatch(int handle);
+
 /*
  * Stores a key value pair and associates it with the specified Config struct
+ * If the key is already set its value is replaced.
+ * A watched config only takes its values from its file, so each published
+ * snapshot stays as it was loaded.
  * Returns CONFIG_SUCCESS if the call is successful
  * Possible error return codes are:
  * 		CONFIG_INVALID_HANDLE
+ * 		CONFIG_WATCHED
  * 		CONFIG_FAILED
  */
 int config_set(int handle, char *key, char *value);
@@ -61,11 +172,26 @@ int config_set(int handle, char *key, char *value);
  * config_create initialises an empty Config structure.
  * Successful initiliasation results in a positive handle being returned.
  * 		This handle is used in subsequent config requests.
+ * Handles resolve in constant time and may be used from any thread. Once a
+ * config is closed its handle is rejected with CONFIG_INVALID_HANDLE, even
+ * after the slot behind it is reused by a later config_create().
+ * Changes to a config are serialised on its lock, while lookups go
+ * through without one.
+ * Possible error return codes are:
+ *		CONFIG_FAILED
  */
 int config_create();
 
 void config_set_filename(int handle, char *filename);
 
+/*
+ * Copies the memory used by the specified config into stats.
+ * Returns CONFIG_SUCCESS if the call is successful
+ * Possible error return codes are:
+ * 		CONFIG_INVALID_HANDLE
+ */
+int config_get_stats(int handle, ConfigStats *stats);
+
 int config_save(int handle);
 
 #endif
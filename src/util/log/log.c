@@ -1,21 +1,97 @@
 #include "log.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
-static unsigned char log_levels;
+#include "logbinary.h"
+#include "logfile.h"
+#include "../misc/mapfile.h"
+#include "../misc/mpmc.h"
+#include "../misc/thread.h"
+#include "../misc/timeutils.h"
+
+#define LOG_WRITE_BATCH		65536	// bytes gathered by the writer per write()
+
+/*
+ * A message waiting for the async writer. The text already ends in a newline.
+ */
+struct sLogRecord {
+	unsigned int length;
+	unsigned char level;
+	char text[LOG_RECORD_SIZE + 1];
+};
+
+typedef struct sLogRecord LogRecord;
+
+unsigned char log_levels;
 static unsigned char output_options;
-static FILE *fp;
+static LogFile *log_file;
+
+/*
+ * Async mode. Records cycle from free_records to pending_records and back.
+ * Running out of free records is what triggers the overflow policy, so
+ * pending_records can never fill up.
+ */
+static LogRecord *records;
+static Mpmc *free_records;
+static Mpmc *pending_records;
+static Thread writer;
+static unsigned char overflow_policy = LOG_OVERFLOW_BLOCK;
+static unsigned long long dropped;
 
 /*
- * Opens a log file for writing
+ * A format string seen by the binary log. fmt is set last, once the rest of
+ * the entry is filled in, so lookups can be made without taking format_lock.
+ */
+struct sLogFormat {
+	const char *fmt;
+	unsigned int id;
+	int count;					// arguments taken, -1 if it can't be recorded
+	unsigned char types[LOG_MAX_ARGS];
+	int precisions[LOG_MAX_ARGS];	// LOG_PRECISION_x or digits after '.'
+};
+
+typedef struct sLogFormat LogFormat;
+
+/*
+ * A single argument collected for a binary message.
+ */
+union uLogValue {
+	long long i;
+	double d;
+	const char *s;
+};
+
+typedef union uLogValue LogValue;
+
+/*
+ * Binary mode. formats is an open addressing table keyed by the address of
+ * the format string. binary_used is the number of bytes of binary_file handed
+ * out so far and may run past the end once the file is full.
+ */
+static LogFormat formats[LOG_MAX_FORMATS];
+static unsigned int format_count;
+static Mutex format_lock;
+static MapFile binary_file;
+static unsigned long long binary_used;
+
+/*
+ * Opens a log file for appending
  */
 static
 void
 open_file(const char *filename) {
-	fp = fopen(filename, "w");
+	log_file = logfile_open(filename);
 	
-	if (fp == NULL) {
+	if (log_file == NULL) {
 		printf("Could not open log file for writing (%s).\n" \
 			"Logs will only be sent to STDOUT.", filename);
 	}
@@ -24,23 +100,513 @@ open_file(const char *filename) {
 static
 void
 close_file() {
-	if (fp == NULL) {
+	if (log_file == NULL) {
 		log_write(LOG_LEVEL_WARN, "Log file could not be closed. File is not " \
 			"open.");
 		return;
 	}
 	
-	fclose(fp);
+	logfile_close(log_file);
+	log_file = NULL;
+}
+
+/*
+ * Writes out the whole buffer, retrying short writes.
+ */
+static
+void
+write_all(int fd, const char *buffer, unsigned int length) {
+	int written;
+
+	while (length > 0) {
+		written = write(fd, buffer, length);
+		if (written <= 0) {
+			return;
+		}
+		buffer += written;
+		length -= written;
+	}
+}
+
+/*
+ * Sends a batch of messages to each output. severe pushes the file's buffer
+ * straight out to disk.
+ */
+static
+void
+write_batch(const char *buffer, unsigned int length, unsigned char severe) {
+	if ((output_options & LOG_TO_STDOUT) == LOG_TO_STDOUT) {
+		write_all(1, buffer, length);
+	}
+
+	if ((output_options & LOG_TO_FILE) == LOG_TO_FILE && log_file != NULL) {
+		logfile_write(log_file, buffer, length);
+		if (severe) {
+			logfile_flush(log_file);
+		}
+	}
+}
+
+/*
+ * Drains pending records until the queue is closed and empty. Records are
+ * copied into one buffer so a burst of messages costs a single write() per
+ * output.
+ */
+static
+void
+writer_main(void *arg) {
+	char *buffer = arg;
+	unsigned int length;
+	unsigned char severe;
+	void *item;
+	LogRecord *record;
+
+	while (mpmc_pop(pending_records, &item)) {
+		length = 0;
+		severe = 0;
+		do {
+			record = item;
+			if (length + record->length > LOG_WRITE_BATCH) {
+				write_batch(buffer, length, severe);
+				length = 0;
+				severe = 0;
+			}
+			memcpy(buffer + length, record->text, record->length);
+			length += record->length;
+			severe |= record->level == LOG_LEVEL_SEVERE;
+			mpmc_push(free_records, record);
+		} while (mpmc_try_pop(pending_records, &item));
+
+		write_batch(buffer, length, severe);
+	}
+
+	free(buffer);
+}
+
+/*
+ * Sets up the record rings and starts the writer thread.
+ * Returns true if async mode could be started.
+ */
+static
+unsigned int
+start_writer() {
+	char *buffer;
+	unsigned int i;
+
+	records = malloc(sizeof(LogRecord) * LOG_ASYNC_RECORDS);
+	buffer = malloc(LOG_WRITE_BATCH);
+	free_records = mpmc_create(LOG_ASYNC_RECORDS, MPMC_BLOCK, NULL);
+	pending_records = mpmc_create(LOG_ASYNC_RECORDS, MPMC_BLOCK, NULL);
+	if (records == NULL || buffer == NULL || free_records == NULL ||
+			pending_records == NULL) {
+		goto failed;
+	}
+
+	for (i = 0; i < LOG_ASYNC_RECORDS; i++) {
+		mpmc_push(free_records, &records[i]);
+	}
+
+	// anything printed before now must come out ahead of the writer's output
+	fflush(stdout);
+
+	if (!thread_create(&writer, writer_main, buffer)) {
+		goto failed;
+	}
+
+	return 1;
+
+failed:
+	if (pending_records != NULL) {
+		mpmc_free(pending_records);
+		pending_records = NULL;
+	}
+	if (free_records != NULL) {
+		mpmc_free(free_records);
+		free_records = NULL;
+	}
+	free(buffer);
+	free(records);
+	records = NULL;
+	return 0;
+}
+
+/*
+ * Writes out everything still queued and stops the writer thread.
+ */
+static
+void
+stop_writer() {
+	mpmc_close(pending_records);
+	thread_join(&writer);
+
+	mpmc_free(pending_records);
+	mpmc_free(free_records);
+	free(records);
+	pending_records = NULL;
+	free_records = NULL;
+	records = NULL;
+	output_options &= ~LOG_ASYNC;
+}
+
+const char *
+log_level_name(unsigned char level) {
+	switch (level) {
+		case LOG_LEVEL_INFO:
+			return "INFO";
+		case LOG_LEVEL_WARN:
+			return "WARN";
+		case LOG_LEVEL_DEBUG:
+			return "DEBUG";
+		case LOG_LEVEL_ERROR:
+			return "ERROR";
+		case LOG_LEVEL_SEVERE:
+			return "SEVERE";
+	}
+
+	return "LOG";
+}
+
+/*
+ * Formats a message, prefixed with its level, into str in a single pass.
+ * Messages longer than size - 1 characters are cut short and end in
+ * LOG_TRUNCATED.
+ * Returns the length of the message.
+ */
+static
+unsigned int
+format_message(char *str, unsigned int size, unsigned char level,
+				const char *fmt, va_list args) {
+	unsigned int pos;
+	int written;
+
+	pos = snprintf(str, size, "[%s] ", log_level_name(level));
+
+	written = vsnprintf(str + pos, size - pos, fmt, args);
+	if (written < 0) {
+		str[pos] = '\0';
+		return pos;
+	}
+	pos += written;
+
+	if (pos >= size) {
+		pos = size - 1;
+		memcpy(str + pos - (sizeof(LOG_TRUNCATED) - 1), LOG_TRUNCATED,
+			sizeof(LOG_TRUNCATED) - 1);
+	}
+
+	return pos;
+}
+
+/*
+ * Hands out length bytes of the binary log, with the record header cleared.
+ * Returns NULL once the file is full.
+ */
+static
+LogBinaryRecord *
+reserve_record(unsigned int length) {
+	unsigned long long offset;
+
+	offset = __atomic_fetch_add(&binary_used, length, __ATOMIC_RELAXED);
+	if (offset + length > binary_file.size) {
+		__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	return (LogBinaryRecord *)((char *)binary_file.data + offset);
+}
+
+/*
+ * Marks a record as complete. The length is written last so a reader never
+ * sees a record that is still being filled in.
+ */
+static
+void
+commit_record(LogBinaryRecord *record, unsigned int length) {
+	__atomic_store_n(&record->length, length, __ATOMIC_RELEASE);
+}
+
+/*
+ * Adds a format string to the table and writes it to the binary log.
+ * Returns the entry, or NULL if the table is full.
+ */
+static
+LogFormat *
+register_format(const char *fmt, unsigned int slot) {
+	LogFormat *format = NULL;
+	LogBinaryRecord *record;
+	unsigned int length;
+	unsigned int i;
+
+	mutex_lock(&format_lock);
+
+	// another thread may have added it since we looked
+	for (i = 0; i < LOG_MAX_FORMATS; i++, slot = (slot + 1) &
+			(LOG_MAX_FORMATS - 1)) {
+		if (formats[slot].fmt == fmt) {
+			format = &formats[slot];
+			break;
+		}
+		if (formats[slot].fmt == NULL) {
+			break;
+		}
+	}
+
+	if (format == NULL && i < LOG_MAX_FORMATS &&
+			format_count < LOG_MAX_FORMATS - 1) {
+		format = &formats[slot];
+		format->id = ++format_count;
+		format->count = logbinary_parse_format(fmt, format->types,
+			format->precisions);
+
+		// formats that can't be recorded are logged preformatted, so the
+		// decoder never needs them
+		if (format->count >= 0) {
+			length = (sizeof(LogBinaryRecord) + strlen(fmt) + 1 + 7) & ~7u;
+			record = reserve_record(length);
+			if (record != NULL) {
+				record->type = LOG_RECORD_FORMAT;
+				record->format_id = format->id;
+				record->timestamp_ns = time_now_ns();
+				strcpy((char *)(record + 1), fmt);
+				commit_record(record, length);
+			}
+		}
+
+		__atomic_store_n(&format->fmt, fmt, __ATOMIC_RELEASE);
+	}
+
+	mutex_unlock(&format_lock);
+	return format;
+}
+
+/*
+ * Returns the table entry for a format string, adding it the first time it
+ * is seen. Returns NULL if the table is full.
+ */
+static
+LogFormat *
+find_format(const char *fmt) {
+	const char *key;
+	unsigned int slot;
+	unsigned int start;
+	unsigned int i;
+
+	start = (unsigned int)(((size_t)fmt >> 3) * 2654435761u) &
+		(LOG_MAX_FORMATS - 1);
+
+	slot = start;
+	for (i = 0; i < LOG_MAX_FORMATS; i++) {
+		key = __atomic_load_n(&formats[slot].fmt, __ATOMIC_ACQUIRE);
+		if (key == fmt) {
+			return &formats[slot];
+		}
+		if (key == NULL) {
+			break;
+		}
+		slot = (slot + 1) & (LOG_MAX_FORMATS - 1);
+	}
+
+	return register_format(fmt, start);
+}
+
+/*
+ * Records a message in the binary log as its format ID followed by the raw
+ * bytes of its arguments. Formats that can't be recorded that way are
+ * formatted here and stored under LOG_FORMAT_PREFORMATTED.
+ */
+static
+void
+write_binary(unsigned char level, const char *fmt, va_list args) {
+	LogFormat *format;
+	LogBinaryRecord *record;
+	LogValue values[LOG_MAX_ARGS];
+	unsigned int lengths[LOG_MAX_ARGS];
+	char text[LOG_RECORD_SIZE];
+	unsigned char preformatted[1] = { LOG_ARG_STRING };
+	int no_precision[1] = { LOG_PRECISION_NONE };
+	unsigned char *types;
+	int *precisions;
+	int precision;
+	unsigned int format_id;
+	unsigned int length;
+	unsigned int count;
+	unsigned int i;
+	char *data;
+	int written;
+
+	format = find_format(fmt);
+	if (format != NULL && format->count >= 0) {
+		format_id = format->id;
+		types = format->types;
+		precisions = format->precisions;
+		count = format->count;
+	} else {
+		written = vsnprintf(text, sizeof(text), fmt, args);
+		if (written < 0) {
+			text[0] = '\0';
+		}
+		format_id = LOG_FORMAT_PREFORMATTED;
+		types = preformatted;
+		precisions = no_precision;
+		count = 1;
+	}
+
+	// collect the arguments first to find out how much room they need
+	length = sizeof(LogBinaryRecord);
+	for (i = 0; i < count; i++) {
+		switch (types[i]) {
+			case LOG_ARG_INT:
+				values[i].i = va_arg(args, int);
+				length += sizeof(int);
+				break;
+			case LOG_ARG_LONG:
+				values[i].i = va_arg(args, long);
+				length += sizeof(long long);
+				break;
+			case LOG_ARG_LONG_LONG:
+				values[i].i = va_arg(args, long long);
+				length += sizeof(long long);
+				break;
+			case LOG_ARG_SIZE:
+				values[i].i = (long long)va_arg(args, size_t);
+				length += sizeof(long long);
+				break;
+			case LOG_ARG_PTRDIFF:
+				values[i].i = va_arg(args, ptrdiff_t);
+				length += sizeof(long long);
+				break;
+			case LOG_ARG_DOUBLE:
+				values[i].d = va_arg(args, double);
+				length += sizeof(double);
+				break;
+			case LOG_ARG_POINTER:
+				values[i].i = (long long)(size_t)va_arg(args, void *);
+				length += sizeof(long long);
+				break;
+			case LOG_ARG_STRING:
+				values[i].s = format_id == LOG_FORMAT_PREFORMATTED ? text :
+					va_arg(args, const char *);
+				if (values[i].s == NULL) {
+					values[i].s = "(null)";
+				}
+
+				// a precision may mean the string is not terminated, so
+				// never read past it. A negative '*' precision is ignored.
+				precision = precisions[i];
+				if (precision == LOG_PRECISION_ARG) {
+					precision = (int)values[i - 1].i;
+				}
+				lengths[i] = strnlen(values[i].s, precision >= 0 &&
+					precision < LOG_RECORD_SIZE ? (size_t)precision :
+					LOG_RECORD_SIZE);
+				length += sizeof(unsigned int) + lengths[i];
+				break;
+		}
+	}
+	length = (length + 7) & ~7u;
+
+	record = reserve_record(length);
+	if (record == NULL) {
+		return;
+	}
+
+	record->type = LOG_RECORD_MESSAGE;
+	record->level = level;
+	record->format_id = format_id;
+	record->timestamp_ns = time_now_ns();
+
+	data = (char *)(record + 1);
+	for (i = 0; i < count; i++) {
+		switch (types[i]) {
+			case LOG_ARG_INT:
+				*(int *)data = (int)values[i].i;
+				data += sizeof(int);
+				break;
+			case LOG_ARG_DOUBLE:
+				memcpy(data, &values[i].d, sizeof(double));
+				data += sizeof(double);
+				break;
+			case LOG_ARG_STRING:
+				memcpy(data, &lengths[i], sizeof(unsigned int));
+				memcpy(data + sizeof(unsigned int), values[i].s, lengths[i]);
+				data += sizeof(unsigned int) + lengths[i];
+				break;
+			default:
+				memcpy(data, &values[i].i, sizeof(long long));
+				data += sizeof(long long);
+				break;
+		}
+	}
+
+	commit_record(record, length);
+}
+
+/*
+ * Maps the binary log and writes its header.
+ * Returns true if the file could be mapped.
+ */
+static
+unsigned int
+open_binary(const char *filename) {
+	LogBinaryHeader *header;
+
+	if (!mapfile_create(&binary_file, filename, LOG_BINARY_BYTES)) {
+		return 0;
+	}
+
+	header = binary_file.data;
+	memcpy(header->magic, LOG_BINARY_MAGIC, sizeof(header->magic));
+	header->version = LOG_BINARY_VERSION;
+	header->start_time = (unsigned long long)time(NULL);
+	header->start_ns = time_now_ns();
+
+	binary_used = sizeof(LogBinaryHeader);
+	memset(formats, '\0', sizeof(formats));
+	format_count = 0;
+	mutex_init(&format_lock);
+
+	return 1;
+}
+
+/*
+ * Unmaps the binary log, trimming it to the records written.
+ */
+static
+void
+close_binary() {
+	unsigned long long used;
+
+	used = binary_used;
+	if (used > binary_file.size) {
+		used = binary_file.size;
+	}
+
+	mapfile_close(&binary_file, used);
+	mutex_destroy(&format_lock);
+	output_options &= ~LOG_BINARY;
 }
 
 unsigned int 
 log_init(unsigned char options, char *filename, 
 			unsigned char levels) {
 	log_levels = levels;
-	output_options = options;
+	output_options = options & ~(LOG_ASYNC | LOG_BINARY);
 	
 	if ((output_options & LOG_TO_FILE) == LOG_TO_FILE) {
-		open_file(filename);
+		if ((options & LOG_BINARY) == LOG_BINARY && open_binary(filename)) {
+			output_options |= LOG_BINARY;
+		} else {
+			open_file(filename);
+		}
+	}
+
+	if ((options & LOG_ASYNC) == LOG_ASYNC) {
+		if (!start_writer()) {
+			log_write(LOG_LEVEL_WARN, "Could not start the log writer. " \
+				"Logs will be written synchronously.");
+			return 1;
+		}
+		output_options |= LOG_ASYNC;
 	}
 	
 	return 1;
@@ -48,54 +614,54 @@ log_init(unsigned char options, char *filename,
 
 void 
 log_write(unsigned char level, const char *fmt, ...) {
-	char str[1024];
-	char level_str[7];
-	char *s_arg;
-	int i_arg;
-	char c;
+	char str[LOG_RECORD_SIZE + 1];
+	LogRecord *record;
+	void *item;
+	unsigned int length;
 	va_list args;
 	
 	// Only continue if the log level for this write is one we are watching
 	if ((log_levels & level) != level) {
 		return;
 	}
-	
-	if (level == LOG_LEVEL_INFO) {
-		sprintf(level_str, "INFO");
-	} else if(level == LOG_LEVEL_WARN) {
-		sprintf(level_str, "WARN");
-	} else if(level == LOG_LEVEL_DEBUG) {
-		sprintf(level_str, "DEBUG");
-	} else if(level == LOG_LEVEL_ERROR) {
-		sprintf(level_str, "ERROR");
-	} else if(level == LOG_LEVEL_SEVERE) {
-		sprintf(level_str, "SEVERE");
+
+	if ((output_options & (LOG_TO_FILE | LOG_BINARY)) ==
+			(LOG_TO_FILE | LOG_BINARY)) {
+		va_start(args, fmt);
+		write_binary(level, fmt, args);
+		va_end(args);
+
+		// the console still gets text
+		if ((output_options & LOG_TO_STDOUT) != LOG_TO_STDOUT) {
+			return;
+		}
 	}
-	
-	sprintf(str, "[%s] ", level_str);
-	
-	// deal with the variable arguments
-	va_start(args, fmt);
-	
-	while(*fmt) {
-		if ((c = *fmt++) == '%') {
-			switch(*fmt) {
-				case 's':	// string
-					s_arg = va_arg(args, char *);
-					strcat(str, s_arg);
-					fmt++;
-					break;
-				case 'd':	// string
-					i_arg = va_arg(args, int);
-					sprintf(str, "%s%d", str, i_arg);
-					fmt++;
-					break;
+
+	if ((output_options & LOG_ASYNC) == LOG_ASYNC) {
+		// the overflow policy applies when every record is still queued
+		if (!mpmc_try_pop(free_records, &item)) {
+			if (overflow_policy == LOG_OVERFLOW_DROP ||
+					!mpmc_pop(free_records, &item)) {
+				__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+				return;
 			}
-		} else {
-			sprintf(str, "%s%c", str, c);
 		}
+		record = item;
+
+		va_start(args, fmt);
+		length = format_message(record->text, LOG_RECORD_SIZE, level, fmt,
+			args);
+		va_end(args);
+
+		record->text[length] = '\n';
+		record->length = length + 1;
+		record->level = level;
+		mpmc_push(pending_records, record);
+		return;
 	}
 	
+	va_start(args, fmt);
+	length = format_message(str, LOG_RECORD_SIZE, level, fmt, args);
 	va_end(args);
 	
 	// Log to the console
@@ -103,8 +669,14 @@ log_write(unsigned char level, const char *fmt, ...) {
 		printf("%s\n", str);
 	}
 	
-	if ((output_options & LOG_TO_FILE) == LOG_TO_FILE) {
-		fprintf(fp, "%s\n", str);
+	if ((output_options & LOG_TO_FILE) == LOG_TO_FILE && log_file != NULL) {
+		str[length] = '\n';
+		logfile_write(log_file, str, length + 1);
+
+		// severe failures may be followed by a crash, so don't hold them back
+		if (level == LOG_LEVEL_SEVERE) {
+			logfile_flush(log_file);
+		}
 	}
 }
 
@@ -115,10 +687,43 @@ log_set_levels(unsigned char new_levels) {
 
 void
 log_set_output_options(unsigned char new_options) {
-	output_options = new_options;
+	output_options = (new_options & ~(LOG_ASYNC | LOG_BINARY)) |
+		(output_options & (LOG_ASYNC | LOG_BINARY));
 }
 
-void log_close() {
-	close_file();
+void
+log_set_overflow_policy(unsigned char policy) {
+	overflow_policy = policy;
+}
+
+void
+log_set_rotation(unsigned long long max_bytes, unsigned int max_age_s,
+					unsigned int retention) {
+	if (log_file != NULL) {
+		logfile_set_rotation(log_file, max_bytes, max_age_s, retention);
+	}
 }
 
+void
+log_set_flush_interval(unsigned int interval_ms) {
+	if (log_file != NULL) {
+		logfile_set_flush_interval(log_file, interval_ms);
+	}
+}
+
+unsigned long long
+log_get_dropped() {
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+void log_close() {
+	if ((output_options & LOG_ASYNC) == LOG_ASYNC) {
+		stop_writer();
+	}
+
+	if ((output_options & LOG_BINARY) == LOG_BINARY) {
+		close_binary();
+	} else {
+		close_file();
+	}
+}
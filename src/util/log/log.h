@@ -3,6 +3,32 @@
 
 #define LOG_TO_STDOUT		1
 #define LOG_TO_FILE			2
+#define LOG_ASYNC			4	// hand messages to a background writer thread
+#define LOG_BINARY			8	// record file messages unformatted, see below
+
+/*
+ * What an async log_write() does when every record is waiting to be written.
+ */
+#define LOG_OVERFLOW_BLOCK	1	// wait for the writer to catch up
+#define LOG_OVERFLOW_DROP	2	// discard the message and count it
+
+#define LOG_RECORD_SIZE		1024	// longest message, including the level
+#define LOG_TRUNCATED		"[...]"	// ends messages that were cut short
+#define LOG_ASYNC_RECORDS	1024	// messages that can wait for the writer
+
+/*
+ * LOG_BINARY replaces the text log file with a memory-mapped binary log. Each
+ * message is stored as its format string ID, a timestamp and the raw bytes of
+ * its arguments, and is only turned into text by the logdecode tool. The file
+ * is LOG_BINARY_BYTES long while it is open and is trimmed on log_close().
+ * Messages that no longer fit are dropped and counted.
+ * Note: fmt must point at a string that lives as long as the log, which is
+ *		the case for string literals. It identifies the format.
+ */
+#ifndef LOG_BINARY_BYTES
+#define LOG_BINARY_BYTES	(64 * 1024 * 1024)
+#endif
+#define LOG_MAX_FORMATS		4096	// distinct format strings in a binary log
 
 #define LOG_LEVEL_INFO		1
 #define LOG_LEVEL_WARN 		2
@@ -10,15 +36,60 @@
 #define LOG_LEVEL_ERROR		8
 #define LOG_LEVEL_SEVERE	16
 
-#define LOG_DEBUG(...) 		log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
-#define LOG_INFO(...) 		log_write(LOG_LEVEL_INFO, __VA_ARGS__)
-#define LOG_ERROR(...) 		log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
-#define LOG_WARN(...) 		log_write(LOG_LEVEL_WARN, __VA_ARGS__)
-#define LOG_SEVERE(...) 	log_write(LOG_LEVEL_SEVERE, __VA_ARGS__)
+/*
+ * Levels compiled into the build. LOG_x statements for any other level are
+ * removed entirely. Defaults to every level in DEBUG builds and every level
+ * but LOG_LEVEL_DEBUG otherwise.
+ */
+#ifndef LOG_COMPILE_LEVELS
+#ifdef DEBUG
+#define LOG_COMPILE_LEVELS	(LOG_LEVEL_INFO | LOG_LEVEL_WARN | LOG_LEVEL_DEBUG | \
+								LOG_LEVEL_ERROR | LOG_LEVEL_SEVERE)
+#else
+#define LOG_COMPILE_LEVELS	(LOG_LEVEL_INFO | LOG_LEVEL_WARN | \
+								LOG_LEVEL_ERROR | LOG_LEVEL_SEVERE)
+#endif
+#endif
+
+#ifdef __GNUC__
+#define LOG_UNLIKELY(x)		__builtin_expect(!!(x), 0)
+#else
+#define LOG_UNLIKELY(x)		(x)
+#endif
+
+/*
+ * Levels currently being written. Set through log_init() and
+ * log_set_levels(). It is exposed so the LOG_x macros can test it inline.
+ */
+extern unsigned char log_levels;
+
+/*
+ * Writes the message only if the level is compiled in and switched on. The
+ * check is made at the call site, so the arguments are not evaluated unless
+ * the message is written. Levels missing from LOG_COMPILE_LEVELS test a
+ * constant and are dropped by the compiler.
+ */
+#define LOG_AT(level, ...) \
+	do { \
+		if (((LOG_COMPILE_LEVELS) & (level)) && \
+				LOG_UNLIKELY(log_levels & (level))) { \
+			log_write(level, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define LOG_DEBUG(...) 		LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) 		LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_ERROR(...) 		LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) 		LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_SEVERE(...) 	LOG_AT(LOG_LEVEL_SEVERE, __VA_ARGS__)
 
 /*
  * Initialising logging.
- * options takes one or many LOG_TO_x flags.
+ * options takes one or many LOG_TO_x flags. LOG_TO_FILE appends to filename
+ *		through a buffer (see util/log/logfile.h). Adding LOG_ASYNC makes
+ *		log_write() queue each message for a writer thread, which writes them
+ *		out in batches.
+ *		Adding LOG_BINARY writes the file in binary form.
  * filename is required if LOG_TO_FILE is flagged in output_options
  * levels takes one or many LOG_LEVEL_x flags and determines which messages
  * are send to the output queue.
@@ -29,7 +100,8 @@ unsigned int log_init(unsigned char options, char *filename,
 
 /*
  * Ensures all logging related resources are freed and file descriptors are 
- * closed.
+ * closed. In async mode every message queued before the call is written out
+ * before the writer thread is stopped.
  * Note: If you called log_init() you should make sure that you call log_close()
  */
 void log_close();
@@ -38,10 +110,14 @@ void log_close();
  * Write out to the log.
  * level takes a single LOG_LEVEL_x and indicates the type of log that is being
  * 		written to.
- * fmt takes a format similar to that in printf or scanf with the varadic
- *		arguments corresponding to each token in the fmt.
+ * fmt takes a printf format with the varadic arguments corresponding to each
+ *		token in the fmt.
  */
-void log_write(unsigned char level, const char *fmt, ...);
+void log_write(unsigned char level, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
 
 /*
  * Used to adjust log levels after logging has already been initialised.
@@ -51,8 +127,45 @@ void log_set_levels(unsigned char new_levels);
 
 /*
  * Used to adjust output options after logging has already been initialised.
- * new_options accepts one or many LOG_TO_x flags.
+ * new_options accepts one or many LOG_TO_x flags. LOG_ASYNC and LOG_BINARY
+ *		can only be chosen by log_init().
  */
 void log_set_output_options(unsigned char new_options);
 
+/*
+ * Sets what happens in async mode when log_write() finds no free record.
+ * policy takes a single LOG_OVERFLOW_x value. Defaults to LOG_OVERFLOW_BLOCK.
+ */
+void log_set_overflow_policy(unsigned char policy);
+
+/*
+ * Sets when the text log file is rotated. The file is renamed to
+ * filename.1 (older files move up a number) and a new one is started.
+ * max_bytes rotates the file before it would grow past this size.
+ * max_age_s rotates the file once it has been open this many seconds.
+ * retention is the number of rotated files kept. Defaults to 5.
+ * Passing 0 for max_bytes or max_age_s turns that limit off, which is the
+ * default for both.
+ */
+void log_set_rotation(unsigned long long max_bytes, unsigned int max_age_s,
+						unsigned int retention);
+
+/*
+ * Sets how long text may wait in the log file's buffer before it is written
+ * out. LOG_LEVEL_SEVERE messages are always written out at once. Passing 0
+ * only writes the buffer once it fills. Defaults to 1000.
+ */
+void log_set_flush_interval(unsigned int interval_ms);
+
+/*
+ * Returns the number of messages discarded under LOG_OVERFLOW_DROP or because
+ * the binary log was full.
+ */
+unsigned long long log_get_dropped();
+
+/*
+ * Returns the name printed at the start of messages of the specified level.
+ */
+const char *log_level_name(unsigned char level);
+
 #endif
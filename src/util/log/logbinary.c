@@ -0,0 +1,131 @@
+#include <string.h>
+
+#include "logbinary.h"
+
+/*
+ * Returns the LOG_ARG_x taken by a conversion type with the specified length
+ * modifier.
+ */
+static
+unsigned char
+arg_type(char conversion, const char *modifier, unsigned int modifier_length) {
+	switch (conversion) {
+		case '%':
+			return modifier_length == 0 ? LOG_ARG_NONE : LOG_ARG_INVALID;
+
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+			if (modifier_length == 0 || modifier[0] == 'h') {
+				return LOG_ARG_INT;
+			}
+			if (modifier_length == 2 || modifier[0] == 'q' ||
+					modifier[0] == 'j') {
+				return LOG_ARG_LONG_LONG;
+			}
+			if (modifier[0] == 'l') {
+				return LOG_ARG_LONG;
+			}
+			if (modifier[0] == 'z') {
+				return LOG_ARG_SIZE;
+			}
+			if (modifier[0] == 't') {
+				return LOG_ARG_PTRDIFF;
+			}
+			return LOG_ARG_INVALID;
+
+		case 'c':
+			return modifier_length == 0 ? LOG_ARG_INT : LOG_ARG_INVALID;
+
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+		case 'a': case 'A':
+			// long double has no portable size, so it is left out
+			return modifier_length == 0 || modifier[0] == 'l' ?
+				LOG_ARG_DOUBLE : LOG_ARG_INVALID;
+
+		case 'p':
+			return modifier_length == 0 ? LOG_ARG_POINTER : LOG_ARG_INVALID;
+
+		case 's':
+			return modifier_length == 0 ? LOG_ARG_STRING : LOG_ARG_INVALID;
+	}
+
+	return LOG_ARG_INVALID;
+}
+
+const char *
+logbinary_next_spec(const char *fmt, LogSpec *spec) {
+	const char *modifier;
+
+	fmt = strchr(fmt, '%');
+	if (fmt == NULL) {
+		return NULL;
+	}
+
+	spec->start = fmt++;
+	spec->stars = 0;
+
+	// flags, width and precision
+	while (*fmt != '\0' && strchr("-+ #0'", *fmt) != NULL) {
+		fmt++;
+	}
+	while ((*fmt >= '0' && *fmt <= '9') || *fmt == '*') {
+		spec->stars += *fmt++ == '*';
+	}
+	spec->precision = LOG_PRECISION_NONE;
+	if (*fmt == '.') {
+		fmt++;
+		if (*fmt == '*') {
+			spec->stars++;
+			spec->precision = LOG_PRECISION_ARG;
+			fmt++;
+		} else {
+			spec->precision = 0;
+			while (*fmt >= '0' && *fmt <= '9') {
+				spec->precision = spec->precision * 10 + *fmt++ - '0';
+			}
+		}
+	}
+
+	modifier = fmt;
+	while (*fmt != '\0' && strchr("hlLqjzt", *fmt) != NULL) {
+		fmt++;
+	}
+
+	if (*fmt == '\0') {
+		spec->type = LOG_ARG_INVALID;
+		spec->length = fmt - spec->start;
+		return fmt;
+	}
+
+	spec->type = arg_type(*fmt, modifier, fmt - modifier);
+	fmt++;
+	spec->length = fmt - spec->start;
+
+	return fmt;
+}
+
+int
+logbinary_parse_format(const char *fmt, unsigned char *types,
+						int *precisions) {
+	LogSpec spec;
+	int count = 0;
+	unsigned int i;
+
+	while ((fmt = logbinary_next_spec(fmt, &spec)) != NULL) {
+		if (spec.type == LOG_ARG_INVALID ||
+				count + spec.stars + 1 > LOG_MAX_ARGS) {
+			return -1;
+		}
+		if (spec.type == LOG_ARG_NONE) {
+			continue;
+		}
+
+		for (i = 0; i < spec.stars; i++) {
+			precisions[count] = LOG_PRECISION_NONE;
+			types[count++] = LOG_ARG_INT;
+		}
+		precisions[count] = spec.precision;
+		types[count++] = spec.type;
+	}
+
+	return count;
+}
@@ -0,0 +1,99 @@
+#ifndef LOG_BINARY_H
+#define LOG_BINARY_H
+
+/*
+ * Layout of the binary log written under LOG_BINARY, shared with the
+ * logdecode tool.
+ *
+ * The file starts with a LogBinaryHeader followed by records, each starting
+ * with a LogBinaryRecord and padded to a multiple of 8 bytes. The first time a
+ * format string is used it is written out in a LOG_RECORD_FORMAT record that
+ * gives it an ID. After that each message is a LOG_RECORD_MESSAGE holding the
+ * format ID and the raw bytes of its arguments, in order:
+ *	LOG_ARG_INT				4 bytes
+ *	LOG_ARG_DOUBLE			8 bytes
+ *	LOG_ARG_POINTER			8 bytes
+ *	LOG_ARG_STRING			4 byte length followed by the characters
+ *	anything else			8 bytes
+ * Format ID 0 is reserved for messages that were formatted when they were
+ * logged. They carry a single LOG_ARG_STRING.
+ * A record whose length is still 0 was never finished and ends the log.
+ */
+
+#define LOG_BINARY_MAGIC		"VLOG"
+#define LOG_BINARY_VERSION		1
+
+#define LOG_RECORD_FORMAT		1
+#define LOG_RECORD_MESSAGE		2
+
+#define LOG_FORMAT_PREFORMATTED	0
+
+#define LOG_ARG_NONE			0	// %% takes no argument
+#define LOG_ARG_INT				1	// int and anything promoted to it
+#define LOG_ARG_LONG			2
+#define LOG_ARG_LONG_LONG		3
+#define LOG_ARG_SIZE			4	// size_t (%zu)
+#define LOG_ARG_PTRDIFF			5	// ptrdiff_t (%td)
+#define LOG_ARG_DOUBLE			6
+#define LOG_ARG_POINTER			7
+#define LOG_ARG_STRING			8
+#define LOG_ARG_INVALID			255	// can't be recorded in binary form
+
+#define LOG_MAX_ARGS			16
+
+#define LOG_PRECISION_NONE		-1	// conversion has no precision
+#define LOG_PRECISION_ARG		-2	// precision is the '*' argument before it
+
+struct sLogBinaryHeader {
+	char magic[4];
+	unsigned int version;
+	unsigned long long start_time;	// wall clock seconds when the log opened
+	unsigned long long start_ns;	// record timestamps are relative to this
+};
+
+typedef struct sLogBinaryHeader LogBinaryHeader;
+
+struct sLogBinaryRecord {
+	unsigned int length;			// whole record including padding
+	unsigned char type;				// LOG_RECORD_x
+	unsigned char level;			// LOG_LEVEL_x of a message
+	unsigned short reserved;
+	unsigned int format_id;
+	unsigned int reserved2;
+	unsigned long long timestamp_ns;
+};
+
+typedef struct sLogBinaryRecord LogBinaryRecord;
+
+/*
+ * A single conversion in a format string.
+ */
+struct sLogSpec {
+	const char *start;				// the '%' opening the conversion
+	unsigned int length;			// characters up to and including the type
+	unsigned char type;				// LOG_ARG_x
+	unsigned char stars;			// '*' widths and precisions taken first
+	int precision;					// digits after '.', or LOG_PRECISION_x
+};
+
+typedef struct sLogSpec LogSpec;
+
+/*
+ * Finds the next conversion in fmt and describes it in spec.
+ * Returns a pointer to the character following the conversion, or NULL if
+ * there are no more.
+ */
+const char *logbinary_next_spec(const char *fmt, LogSpec *spec);
+
+/*
+ * Works out the argument types taken by a format string. '*' widths and
+ * precisions appear as LOG_ARG_INT ahead of the value they apply to.
+ * precisions receives the precision of each argument, so strings can be
+ * bounded by it.
+ * Returns the number of arguments, or -1 if the format can't be recorded in
+ * binary form.
+ */
+int logbinary_parse_format(const char *fmt, unsigned char *types,
+							int *precisions);
+
+#endif
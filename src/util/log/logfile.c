@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "logfile.h"
+#include "../misc/timeutils.h"
+
+#ifdef _WIN32
+#define LOG_OPEN_FLAGS		(O_WRONLY | O_CREAT | O_APPEND | O_BINARY)
+#else
+#define LOG_OPEN_FLAGS		(O_WRONLY | O_CREAT | O_APPEND)
+#endif
+
+/*
+ * Room for the path plus a suffix such as ".rotating.4294967295".
+ */
+#define LOG_SUFFIX_SIZE		24
+
+/*
+ * Failures in here can't be logged without coming straight back in, so they
+ * are left for the caller to notice in the file itself.
+ */
+
+/*
+ * Opens the file at the current path.
+ * Returns 1 if it was opened.
+ */
+static
+unsigned int
+open_current(LogFile *file) {
+	file->fd = open(file->path, LOG_OPEN_FLAGS, 0644);
+	return file->fd >= 0;
+}
+
+/*
+ * Writes a buffer to the file. Runs on the helper thread without the lock.
+ */
+static
+void
+write_out(LogFile *file, const char *buffer, unsigned int used) {
+	unsigned int done = 0;
+	int written;
+
+	while (done < used && file->fd >= 0) {
+		written = write(file->fd, buffer + done, used - done);
+		if (written <= 0) {
+			break;
+		}
+		done += written;
+	}
+}
+
+/*
+ * Gives the buffer to the helper thread to write out and starts filling the
+ * spare one. rotate has the helper start a new file once it is written.
+ * Called with the lock held and nothing pending.
+ */
+static
+void
+hand_off(LogFile *file, unsigned char rotate) {
+	file->pending = file->buffer;
+	file->pending_used = file->used;
+	file->pending_rotate = rotate;
+	file->buffer = file->spare;
+	file->spare = NULL;
+	file->used = 0;
+	cond_signal(&file->wake);
+}
+
+/*
+ * Builds the name of rotated file number (path.number) or, if staging is set,
+ * the name a file waits under until the helper thread files it.
+ */
+static
+void
+rotated_name(LogFile *file, char *name, unsigned int number,
+				unsigned char staging) {
+	sprintf(name, staging ? "%s.rotating.%u" : "%s.%u", file->path, number);
+}
+
+/*
+ * Moves the current file aside under a staging name and starts a new one.
+ * Runs on the helper thread without the lock.
+ * Returns 1 if the file was moved aside.
+ */
+static
+unsigned int
+rotate(LogFile *file) {
+	char *staged;
+	unsigned int renamed;
+
+	staged = malloc(strlen(file->path) + LOG_SUFFIX_SIZE);
+	if (staged == NULL) {
+		return 0;
+	}
+	rotated_name(file, staged, file->staged, 1);
+
+	if (file->fd >= 0) {
+		close(file->fd);
+	}
+
+	// if the rename failed the old file carries on
+	renamed = rename(file->path, staged) == 0;
+	free(staged);
+
+	open_current(file);
+	return renamed;
+}
+
+/*
+ * Files a rotated file as path.1, moving the older ones up a number and
+ * deleting any past the retention count. Runs on the helper thread without
+ * the lock.
+ */
+static
+void
+retire(LogFile *file, unsigned int staged, unsigned int retention) {
+	char *from;
+	char *to;
+	unsigned int i;
+
+	from = malloc(strlen(file->path) + LOG_SUFFIX_SIZE);
+	to = malloc(strlen(file->path) + LOG_SUFFIX_SIZE);
+	if (from == NULL || to == NULL) {
+		free(from);
+		free(to);
+		return;
+	}
+
+	if (retention == 0) {
+		rotated_name(file, from, staged, 1);
+		remove(from);
+		free(from);
+		free(to);
+		return;
+	}
+
+	rotated_name(file, to, retention, 0);
+	remove(to);
+
+	for (i = retention - 1; i > 0; i--) {
+		rotated_name(file, from, i, 0);
+		rotated_name(file, to, i + 1, 0);
+		rename(from, to);
+	}
+
+	rotated_name(file, from, staged, 1);
+	rotated_name(file, to, 1, 0);
+	rename(from, to);
+
+	free(from);
+	free(to);
+}
+
+/*
+ * Writes out handed off buffers, rotates and files logs and hands off buffers
+ * that have waited for the flush interval, until the file is closed.
+ */
+static
+void
+helper_main(void *arg) {
+	LogFile *file = arg;
+	unsigned long long waited_ms;
+	unsigned int staged;
+	unsigned int retention;
+	unsigned int renamed;
+	unsigned char rotating;
+	char *buffer;
+
+	mutex_lock(&file->lock);
+	for (;;) {
+		if (file->pending != NULL) {
+			buffer = file->pending;
+			rotating = file->pending_rotate;
+
+			mutex_unlock(&file->lock);
+			write_out(file, buffer, file->pending_used);
+			renamed = rotating && rotate(file);
+			mutex_lock(&file->lock);
+
+			if (renamed) {
+				file->staged++;
+			}
+			file->spare = buffer;
+			file->pending = NULL;
+			cond_broadcast(&file->drained);
+			continue;
+		}
+
+		// rotations next, so close() leaves them all filed. A writer may hand
+		// off a buffer while the lock is dropped, so start over after each.
+		if (file->retired != file->staged) {
+			staged = file->retired;
+			retention = file->retention;
+
+			mutex_unlock(&file->lock);
+			retire(file, staged, retention);
+			mutex_lock(&file->lock);
+
+			file->retired++;
+			continue;
+		}
+
+		if (file->stopping) {
+			if (file->used > 0) {
+				hand_off(file, 0);
+				continue;
+			}
+			break;
+		}
+
+		if (file->used == 0 || file->flush_ms == 0) {
+			cond_wait(&file->wake, &file->lock);
+			continue;
+		}
+
+		waited_ms = (time_now_ns() - file->dirty_ns) / 1000000;
+		if (waited_ms >= file->flush_ms) {
+			hand_off(file, 0);
+			continue;
+		}
+		cond_timedwait(&file->wake, &file->lock,
+			file->flush_ms - (unsigned int)waited_ms);
+	}
+	mutex_unlock(&file->lock);
+}
+
+LogFile *
+logfile_open(const char *path) {
+	LogFile *file;
+	struct stat info;
+
+	file = malloc(sizeof(LogFile));
+	if (file == NULL) {
+		return NULL;
+	}
+	memset(file, '\0', sizeof(LogFile));
+
+	file->path = malloc(strlen(path) + 1);
+	file->buffer = malloc(LOG_FILE_BUFFER);
+	file->spare = malloc(LOG_FILE_BUFFER);
+	if (file->path == NULL || file->buffer == NULL || file->spare == NULL) {
+		goto failed;
+	}
+	strcpy(file->path, path);
+
+	if (!open_current(file)) {
+		goto failed;
+	}
+	file->size = fstat(file->fd, &info) == 0 ? (unsigned long long)
+		info.st_size : 0;
+	file->opened_ns = time_now_ns();
+
+	file->retention = LOG_FILE_RETENTION;
+	file->flush_ms = LOG_FILE_FLUSH_MS;
+
+	mutex_init(&file->lock);
+	cond_init(&file->wake);
+	cond_init(&file->drained);
+	if (!thread_create(&file->helper, helper_main, file)) {
+		cond_destroy(&file->drained);
+		cond_destroy(&file->wake);
+		mutex_destroy(&file->lock);
+		close(file->fd);
+		goto failed;
+	}
+
+	return file;
+
+failed:
+	free(file->spare);
+	free(file->buffer);
+	free(file->path);
+	free(file);
+	return NULL;
+}
+
+void
+logfile_write(LogFile *file, const char *text, unsigned int length) {
+	unsigned long long now;
+	unsigned int room;
+	unsigned int chunk;
+
+	mutex_lock(&file->lock);
+
+	// read every time as a hand off below can empty the buffer and restart
+	// the flush interval
+	now = time_now_ns();
+
+	// an empty file is never rotated. Whatever is buffered belongs to the old
+	// file, so it goes to the helper along with the rotation.
+	while (file->size > 0 && ((file->max_bytes > 0 &&
+			file->size + length > file->max_bytes) ||
+			(file->max_age_s > 0 && now - file->opened_ns >=
+			file->max_age_s * 1000000000ULL))) {
+		if (file->pending != NULL) {
+			cond_wait(&file->drained, &file->lock);
+			continue;
+		}
+		hand_off(file, 1);
+		file->size = 0;
+		file->opened_ns = now;
+	}
+
+	while (length > 0) {
+		room = LOG_FILE_BUFFER - file->used;
+
+		// swap buffers rather than split text that would fit in an empty one.
+		// Only when both are full does the writer wait on the helper.
+		if (room == 0 || (length > room && length <= LOG_FILE_BUFFER)) {
+			if (file->pending != NULL) {
+				cond_wait(&file->drained, &file->lock);
+			} else {
+				hand_off(file, 0);
+			}
+			continue;
+		}
+
+		// the helper starts timing the flush interval once data arrives
+		if (file->used == 0) {
+			file->dirty_ns = now;
+			if (file->flush_ms > 0) {
+				cond_signal(&file->wake);
+			}
+		}
+
+		chunk = length < room ? length : room;
+		memcpy(file->buffer + file->used, text, chunk);
+		file->used += chunk;
+		file->size += chunk;
+		text += chunk;
+		length -= chunk;
+	}
+
+	mutex_unlock(&file->lock);
+}
+
+void
+logfile_flush(LogFile *file) {
+	mutex_lock(&file->lock);
+	while (file->used > 0) {
+		if (file->pending != NULL) {
+			cond_wait(&file->drained, &file->lock);
+		} else {
+			hand_off(file, 0);
+		}
+	}
+	while (file->pending != NULL) {
+		cond_wait(&file->drained, &file->lock);
+	}
+	mutex_unlock(&file->lock);
+}
+
+void
+logfile_set_rotation(LogFile *file, unsigned long long max_bytes,
+						unsigned int max_age_s, unsigned int retention) {
+	mutex_lock(&file->lock);
+	file->max_bytes = max_bytes;
+	file->max_age_s = max_age_s;
+	file->retention = retention;
+	mutex_unlock(&file->lock);
+}
+
+void
+logfile_set_flush_interval(LogFile *file, unsigned int interval_ms) {
+	mutex_lock(&file->lock);
+	file->flush_ms = interval_ms;
+	cond_signal(&file->wake);
+	mutex_unlock(&file->lock);
+}
+
+void
+logfile_close(LogFile *file) {
+	// the helper writes out what is left before it stops
+	mutex_lock(&file->lock);
+	file->stopping = 1;
+	cond_signal(&file->wake);
+	mutex_unlock(&file->lock);
+
+	thread_join(&file->helper);
+
+	if (file->fd >= 0) {
+		close(file->fd);
+	}
+	cond_destroy(&file->drained);
+	cond_destroy(&file->wake);
+	mutex_destroy(&file->lock);
+	free(file->spare);
+	free(file->buffer);
+	free(file->path);
+	free(file);
+}
@@ -0,0 +1,100 @@
+#ifndef LOG_FILE_H
+#define LOG_FILE_H
+
+#include "../misc/thread.h"
+
+/*
+ * Buffered log file with size and time based rotation.
+ *
+ * Writes are gathered in one of two LOG_FILE_BUFFER byte buffers. When it
+ * fills, when logfile_flush() is called or once it has held data for the
+ * flush interval, the buffers are swapped and a helper thread writes the full
+ * one out while writers carry on filling the other.
+ * When the file passes the size or age limit the helper writes out what
+ * belongs to the old file, renames it aside and starts a new file at the same
+ * path. It then shuffles the rotated files (path.1 is the newest) and deletes
+ * any beyond the retention count.
+ * All file I/O happens on the helper thread, so a writer only waits when both
+ * buffers are full or it asked for a flush.
+ */
+
+#define LOG_FILE_BUFFER			(256 * 1024)
+#define LOG_FILE_FLUSH_MS		1000	// default flush interval
+#define LOG_FILE_RETENTION		5		// default rotated files kept
+
+struct sLogFile {
+	char *path;
+	int fd;							// only used by the helper once started
+	char *buffer;					// being filled by writers
+	unsigned int used;
+	unsigned long long size;		// bytes written to or bound for the file
+	unsigned long long opened_ns;	// when the current file was started
+	unsigned long long dirty_ns;	// when the buffer last went from empty
+
+	// the buffer handed to the helper, NULL once it has been written out.
+	// spare is the other buffer while the helper is idle.
+	char *pending;
+	unsigned int pending_used;
+	unsigned char pending_rotate;	// rotate the file after writing it
+	char *spare;
+
+	// limits, 0 turns each one off
+	unsigned long long max_bytes;
+	unsigned int max_age_s;
+	unsigned int retention;
+	unsigned int flush_ms;
+
+	// rotated files waiting for the helper are numbered from retired up to
+	// (but not including) staged
+	unsigned int staged;
+	unsigned int retired;
+
+	Mutex lock;
+	Cond wake;
+	Cond drained;					// signalled when pending is written out
+	Thread helper;
+	unsigned char stopping;
+};
+
+typedef struct sLogFile LogFile;
+
+/*
+ * Opens path for appending, creating it if needed, and starts the helper
+ * thread.
+ * Returns NULL if the file could not be opened.
+ * Note: logfile_close() must be called to write out the buffer.
+ */
+LogFile *logfile_open(const char *path);
+
+/*
+ * Appends text to the file. length does not include any terminator.
+ */
+void logfile_write(LogFile *file, const char *text, unsigned int length);
+
+/*
+ * Writes out everything buffered so far and waits for it to reach the file.
+ */
+void logfile_flush(LogFile *file);
+
+/*
+ * Sets when the file is rotated.
+ * max_bytes rotates the file once it would grow past this size.
+ * max_age_s rotates the file once it has been written to for this long.
+ * retention is the number of rotated files kept. Passing 0 deletes them.
+ */
+void logfile_set_rotation(LogFile *file, unsigned long long max_bytes,
+							unsigned int max_age_s, unsigned int retention);
+
+/*
+ * Sets how long data may sit in the buffer before the helper thread writes it
+ * out. Passing 0 leaves it until the buffer fills or is flushed. Defaults to
+ * LOG_FILE_FLUSH_MS.
+ */
+void logfile_set_flush_interval(LogFile *file, unsigned int interval_ms);
+
+/*
+ * Flushes the buffer, finishes any outstanding rotations and closes the file.
+ */
+void logfile_close(LogFile *file);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/*
+ * Allocates a block with room for size bytes. dedicated blocks are placed
+ * behind the one being filled so it stays in use.
+ * Returns the new block or NULL.
+ */
+static
+ArenaBlock *
+add_block(Arena *arena, unsigned long long size, unsigned char dedicated) {
+	ArenaBlock *block;
+
+	block = malloc(sizeof(ArenaBlock) + size);
+	if (block == NULL) {
+		return NULL;
+	}
+	block->size = size;
+	block->used = 0;
+
+	if (dedicated && arena->blocks != NULL) {
+		block->next = arena->blocks->next;
+		arena->blocks->next = block;
+	} else {
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	arena->block_count++;
+	arena->reserved += size;
+	return block;
+}
+
+void
+arena_init(Arena *arena) {
+	memset(arena, '\0', sizeof(Arena));
+	arena->next_size = ARENA_FIRST_BLOCK;
+}
+
+void *
+arena_alloc(Arena *arena, unsigned long long size) {
+	ArenaBlock *block = arena->blocks;
+	void *memory;
+
+	size = (size + ARENA_ALIGN - 1) & ~(unsigned long long)(ARENA_ALIGN - 1);
+
+	if (block == NULL || block->size - block->used < size) {
+		if (size > arena->next_size / 2) {
+			block = add_block(arena, size, 1);
+		} else {
+			block = add_block(arena, arena->next_size, 0);
+			if (arena->next_size < ARENA_MAX_BLOCK) {
+				arena->next_size *= 2;
+			}
+		}
+
+		if (block == NULL) {
+			return NULL;
+		}
+	}
+
+	memory = block->data + block->used;
+	block->used += size;
+	arena->used += size;
+	return memory;
+}
+
+char *
+arena_copy_string(Arena *arena, const char *str, unsigned int length) {
+	char *copy;
+
+	copy = arena_alloc(arena, (unsigned long long)length + 1);
+	if (copy != NULL) {
+		memcpy(copy, str, length);
+		copy[length] = '\0';
+	}
+
+	return copy;
+}
+
+void
+arena_free(Arena *arena) {
+	ArenaBlock *block;
+	ArenaBlock *next;
+
+	for (block = arena->blocks; block != NULL; block = next) {
+		next = block->next;
+		free(block);
+	}
+
+	arena_init(arena);
+}
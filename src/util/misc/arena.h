@@ -0,0 +1,63 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+ * Bump allocator. Memory is carved out of large blocks in order and is only
+ * given back all at once by arena_free(), so allocating is a pointer bump and
+ * tearing down takes one free() per block. Each new block is twice the size
+ * of the last, up to ARENA_MAX_BLOCK, so the number of blocks grows with the
+ * log of the memory used.
+ * An arena is not thread safe.
+ */
+#define ARENA_FIRST_BLOCK	4096
+#define ARENA_MAX_BLOCK		(16 * 1024 * 1024)
+
+/*
+ * Every allocation is aligned to this many bytes.
+ */
+#define ARENA_ALIGN			8
+
+struct sArenaBlock {
+	struct sArenaBlock *next;
+	unsigned long long size;		// bytes in data
+	unsigned long long used;
+	char data[];
+};
+
+typedef struct sArenaBlock ArenaBlock;
+
+struct sArena {
+	ArenaBlock *blocks;				// the block being filled comes first
+	unsigned long long next_size;	// size of the next regular block
+	unsigned int block_count;
+	unsigned long long reserved;	// bytes held in blocks
+	unsigned long long used;		// bytes handed out, including padding
+};
+
+typedef struct sArena Arena;
+
+/*
+ * Prepares an empty arena. Nothing is allocated until the first
+ * arena_alloc().
+ */
+void arena_init(Arena *arena);
+
+/*
+ * Returns size bytes from the arena or NULL if a block could not be
+ * allocated. Requests larger than half a block get a block of their own so
+ * the block being filled isn't abandoned.
+ */
+void *arena_alloc(Arena *arena, unsigned long long size);
+
+/*
+ * Returns a NUL terminated copy of the first length bytes of str in the arena
+ * or NULL if there is no memory.
+ */
+char *arena_copy_string(Arena *arena, const char *str, unsigned int length);
+
+/*
+ * Frees every block, leaving the arena empty and ready to use again.
+ */
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "thread.h"
+#include "../log/log.h"
+
+/*
+ * Starts at 1 so that 0 can mark a reader which is outside.
+ */
+static unsigned long long global_epoch = 1;
+
+static EpochReader *readers;
+static EpochRetired *retired;
+static unsigned char retired_lock;
+
+static __thread EpochReader *local_reader;
+
+static
+void
+lock_retired() {
+	while (__atomic_test_and_set(&retired_lock, __ATOMIC_ACQUIRE)) {
+		thread_yield();
+	}
+}
+
+static
+void
+unlock_retired() {
+	__atomic_clear(&retired_lock, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the calling thread's record, adding one on its first call, or NULL
+ * if there is no memory for it.
+ */
+static
+EpochReader *
+get_reader() {
+	EpochReader *reader = local_reader;
+
+	if (reader != NULL) {
+		return reader;
+	}
+
+	reader = malloc(sizeof(EpochReader));
+	if (reader == NULL) {
+		LOG_SEVERE("Could not register epoch reader. Insufficient memory.");
+		return NULL;
+	}
+	memset(reader, '\0', sizeof(EpochReader));
+
+	// records are only ever added, so a plain push is enough
+	reader->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&readers, &reader->next, reader, 1,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+
+	local_reader = reader;
+	return reader;
+}
+
+/*
+ * Returns the oldest epoch any reader entered in, or the current epoch if no
+ * one is reading.
+ */
+static
+unsigned long long
+oldest_reader() {
+	EpochReader *reader;
+	unsigned long long oldest;
+	unsigned long long epoch;
+
+	oldest = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	for (reader = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); reader != NULL;
+			reader = reader->next) {
+		epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+		if (epoch != 0 && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+
+	return oldest;
+}
+
+void
+epoch_enter() {
+	EpochReader *reader;
+
+	reader = get_reader();
+	if (reader == NULL) {
+		return;
+	}
+
+	// the store has to be visible before any shared pointer is loaded, or a
+	// writer could miss this reader and free what it is about to read
+	if (reader->depth++ == 0) {
+		__atomic_store_n(&reader->epoch,
+			__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	}
+}
+
+void
+epoch_exit() {
+	EpochReader *reader = local_reader;
+
+	if (reader == NULL) {
+		return;
+	}
+
+	if (--reader->depth == 0) {
+		__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+void
+epoch_retire(void *item, ptrEpochFree free_item) {
+	EpochRetired *node;
+	unsigned long long epoch;
+
+	// readers that entered before this point may hold the item
+	epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+
+	node = malloc(sizeof(EpochRetired));
+	if (node == NULL) {
+		// nowhere to queue it, so wait the readers out here
+		while (oldest_reader() < epoch) {
+			thread_yield();
+		}
+		free_item(item);
+		return;
+	}
+	node->item = item;
+	node->free_item = free_item;
+	node->epoch = epoch;
+
+	lock_retired();
+	node->next = retired;
+	retired = node;
+	unlock_retired();
+}
+
+unsigned int
+epoch_reclaim() {
+	EpochRetired **link;
+	EpochRetired *node;
+	EpochRetired *freeable = NULL;
+	unsigned long long oldest;
+	unsigned int waiting = 0;
+
+	oldest = oldest_reader();
+
+	lock_retired();
+	link = &retired;
+	while ((node = *link) != NULL) {
+		if (node->epoch <= oldest) {
+			*link = node->next;
+			node->next = freeable;
+			freeable = node;
+		} else {
+			link = &node->next;
+			waiting++;
+		}
+	}
+	unlock_retired();
+
+	// free outside the lock, the callbacks may be slow
+	while (freeable != NULL) {
+		node = freeable;
+		freeable = node->next;
+		node->free_item(node->item);
+		free(node);
+	}
+
+	return waiting;
+}
+
+void
+epoch_synchronize() {
+	unsigned long long epoch;
+
+	epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+	while (oldest_reader() < epoch) {
+		thread_yield();
+	}
+
+	epoch_reclaim();
+}
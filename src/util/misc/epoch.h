@@ -0,0 +1,72 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch based reclamation for data that is read without locks.
+ *
+ * Readers wrap the code that holds pointers into shared data in
+ * epoch_enter() and epoch_exit(). A writer first unpublishes an item (so no
+ * new reader can find it) and then hands it to epoch_retire(). The item is
+ * freed by a later epoch_reclaim() once every reader that entered before it
+ * was retired has left.
+ *
+ * Each thread gets a small record the first time it calls epoch_enter().
+ * Records are kept for the life of the process.
+ */
+
+#define EPOCH_CACHE_LINE	64
+
+typedef void (*ptrEpochFree)(void *item);
+
+/*
+ * Records are padded so readers don't share a cache line.
+ */
+struct sEpochReader {
+	unsigned long long epoch;		// epoch seen on entry, 0 while outside
+	struct sEpochReader *next;
+	unsigned int depth;				// nested epoch_enter() calls
+	char pad0[EPOCH_CACHE_LINE - sizeof(unsigned long long) - sizeof(void *) -
+		sizeof(unsigned int)];
+};
+
+typedef struct sEpochReader EpochReader;
+
+struct sEpochRetired {
+	void *item;
+	ptrEpochFree free_item;
+	unsigned long long epoch;		// epoch the item was retired in
+	struct sEpochRetired *next;
+};
+
+typedef struct sEpochRetired EpochRetired;
+
+/*
+ * Marks the calling thread as reading. Calls may be nested.
+ */
+void epoch_enter();
+
+/*
+ * Ends the read started by the matching epoch_enter().
+ */
+void epoch_exit();
+
+/*
+ * Queues item to be passed to free_item once no reader can still hold it.
+ * Note: item must already be unreachable for new readers.
+ */
+void epoch_retire(void *item, ptrEpochFree free_item);
+
+/*
+ * Frees every retired item that no reader can still hold.
+ * Returns the number of items still waiting.
+ */
+unsigned int epoch_reclaim();
+
+/*
+ * Waits until everything retired before the call has been freed.
+ * Note: Must not be called between epoch_enter() and epoch_exit(), as the
+ *		calling thread would wait on itself.
+ */
+void epoch_synchronize();
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+#include "filewatch.h"
+#include "../log/log.h"
+
+/*
+ * Reads the file's modification time and size. A missing file reads as
+ * -1 for both, so its return counts as a change.
+ */
+static
+void
+stat_file(FileWatch *watch, long long *mtime, long long *size) {
+	struct stat info;
+
+	if (stat(watch->path, &info) != 0) {
+		*mtime = -1;
+		*size = -1;
+		return;
+	}
+
+	*mtime = (long long)info.st_mtime;
+	*size = (long long)info.st_size;
+}
+
+/*
+ * Checks the file every FILEWATCH_POLL_MS until the watch is stopped.
+ */
+static
+void
+poll_main(FileWatch *watch) {
+	long long mtime;
+	long long size;
+
+	mutex_lock(&watch->lock);
+	while (!watch->stopping) {
+		cond_timedwait(&watch->wake, &watch->lock, FILEWATCH_POLL_MS);
+		if (watch->stopping) {
+			break;
+		}
+
+		stat_file(watch, &mtime, &size);
+		if (mtime == watch->mtime && size == watch->size) {
+			continue;
+		}
+		watch->mtime = mtime;
+		watch->size = size;
+
+		mutex_unlock(&watch->lock);
+		watch->changed(watch->arg);
+		mutex_lock(&watch->lock);
+	}
+	mutex_unlock(&watch->lock);
+}
+
+#ifdef __linux__
+/*
+ * Returns the part of path after the last '/'.
+ */
+static
+const char *
+base_name(const char *path) {
+	const char *slash = strrchr(path, '/');
+
+	return slash != NULL ? slash + 1 : path;
+}
+
+/*
+ * Reads the events waiting on the inotify descriptor.
+ * Returns 1 if any of them were for the watched file.
+ */
+static
+unsigned int
+read_events(FileWatch *watch) {
+	char buffer[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	const char *name = base_name(watch->path);
+	unsigned int matched = 0;
+	ssize_t length;
+	ssize_t offset;
+
+	length = read(watch->inotify, buffer, sizeof(buffer));
+	for (offset = 0; offset < length;
+			offset += sizeof(struct inotify_event) + event->len) {
+		event = (const struct inotify_event *)(buffer + offset);
+		if (event->len > 0 && strcmp(event->name, name) == 0) {
+			matched = 1;
+		}
+	}
+
+	return matched;
+}
+
+/*
+ * Waits on inotify until the watch is stopped. A change is only reported once
+ * no further events have arrived for FILEWATCH_SETTLE_MS, so a file written
+ * in several steps is reported once.
+ */
+static
+void
+inotify_main(FileWatch *watch) {
+	struct pollfd fds[2];
+	unsigned int pending = 0;
+
+	fds[0].fd = watch->inotify;
+	fds[0].events = POLLIN;
+	fds[1].fd = watch->stop_pipe[0];
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		fds[0].revents = 0;
+		fds[1].revents = 0;
+		if (poll(fds, 2, pending ? FILEWATCH_SETTLE_MS : -1) < 0) {
+			continue;
+		}
+
+		if (fds[1].revents != 0) {
+			break;
+		}
+
+		if (fds[0].revents != 0) {
+			if (read_events(watch)) {
+				pending = 1;
+			}
+			continue;
+		}
+
+		// the settle time passed without another event
+		if (pending) {
+			pending = 0;
+			watch->changed(watch->arg);
+		}
+	}
+}
+
+/*
+ * Sets up inotify on the directory holding the file.
+ * Returns 1 if it is ready.
+ */
+static
+unsigned int
+start_inotify(FileWatch *watch) {
+	const char *name = base_name(watch->path);
+	char *directory;
+	int result;
+
+	watch->inotify = inotify_init();
+	if (watch->inotify < 0) {
+		return 0;
+	}
+
+	if (name == watch->path) {
+		result = inotify_add_watch(watch->inotify, ".", IN_CLOSE_WRITE |
+			IN_MOVED_TO | IN_CREATE | IN_DELETE);
+	} else {
+		directory = malloc(name - watch->path + 1);
+		if (directory == NULL) {
+			result = -1;
+		} else {
+			memcpy(directory, watch->path, name - watch->path);
+			directory[name - watch->path] = '\0';
+			result = inotify_add_watch(watch->inotify, directory,
+				IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+			free(directory);
+		}
+	}
+
+	if (result < 0 || pipe(watch->stop_pipe) != 0) {
+		close(watch->inotify);
+		watch->inotify = -1;
+		return 0;
+	}
+
+	return 1;
+}
+#endif
+
+static
+void
+watch_main(void *arg) {
+	FileWatch *watch = arg;
+
+#ifdef __linux__
+	if (watch->inotify >= 0) {
+		inotify_main(watch);
+		return;
+	}
+#endif
+	poll_main(watch);
+}
+
+FileWatch *
+filewatch_start(const char *path, ptrFileChanged changed, void *arg) {
+	FileWatch *watch;
+
+	watch = malloc(sizeof(FileWatch));
+	if (watch == NULL) {
+		LOG_ERROR("Could not watch %s. Insufficient memory.", path);
+		return NULL;
+	}
+	memset(watch, '\0', sizeof(FileWatch));
+
+	watch->path = malloc(strlen(path) + 1);
+	if (watch->path == NULL) {
+		LOG_ERROR("Could not watch %s. Insufficient memory.", path);
+		free(watch);
+		return NULL;
+	}
+	strcpy(watch->path, path);
+	watch->changed = changed;
+	watch->arg = arg;
+	stat_file(watch, &watch->mtime, &watch->size);
+
+#ifdef __linux__
+	if (!start_inotify(watch)) {
+		LOG_WARN("inotify is not available for %s. Polling every %u ms " \
+			"instead.", path, FILEWATCH_POLL_MS);
+	}
+#endif
+
+	mutex_init(&watch->lock);
+	cond_init(&watch->wake);
+	if (!thread_create(&watch->thread, watch_main, watch)) {
+		LOG_ERROR("Could not watch %s. Thread could not be started.", path);
+#ifdef __linux__
+		if (watch->inotify >= 0) {
+			close(watch->inotify);
+			close(watch->stop_pipe[0]);
+			close(watch->stop_pipe[1]);
+		}
+#endif
+		cond_destroy(&watch->wake);
+		mutex_destroy(&watch->lock);
+		free(watch->path);
+		free(watch);
+		return NULL;
+	}
+
+	return watch;
+}
+
+void
+filewatch_stop(FileWatch *watch) {
+	mutex_lock(&watch->lock);
+	watch->stopping = 1;
+	cond_signal(&watch->wake);
+	mutex_unlock(&watch->lock);
+
+#ifdef __linux__
+	if (watch->inotify >= 0 && write(watch->stop_pipe[1], "", 1) != 1) {
+		LOG_ERROR("Could not wake the watch on %s.", watch->path);
+	}
+#endif
+
+	thread_join(&watch->thread);
+
+#ifdef __linux__
+	if (watch->inotify >= 0) {
+		close(watch->inotify);
+		close(watch->stop_pipe[0]);
+		close(watch->stop_pipe[1]);
+	}
+#endif
+	cond_destroy(&watch->wake);
+	mutex_destroy(&watch->lock);
+	free(watch->path);
+	free(watch);
+}
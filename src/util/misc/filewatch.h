@@ -0,0 +1,49 @@
+#ifndef FILEWATCH_H
+#define FILEWATCH_H
+
+#include "thread.h"
+
+/*
+ * Watches a single file and calls back on a thread of its own when it
+ * changes. Linux uses inotify on the file's directory, so files replaced by a
+ * rename (as most editors save) are seen too. Elsewhere, or if inotify is not
+ * available, the file's modification time and size are polled.
+ */
+#define FILEWATCH_POLL_MS	1000	// polling interval without inotify
+#define FILEWATCH_SETTLE_MS	50		// quiet time before a change is reported
+
+typedef void (*ptrFileChanged)(void *arg);
+
+struct sFileWatch {
+	char *path;
+	ptrFileChanged changed;
+	void *arg;
+	Thread thread;
+	Mutex lock;
+	Cond wake;
+	unsigned char stopping;
+	long long mtime;				// last seen by the poller
+	long long size;
+#ifdef __linux__
+	int inotify;					// -1 when polling
+	int stop_pipe[2];				// wakes the inotify thread to stop
+#endif
+};
+
+typedef struct sFileWatch FileWatch;
+
+/*
+ * Starts watching the file at path. changed(arg) is called after each change
+ * once the file has been left alone for FILEWATCH_SETTLE_MS.
+ * Returns the watch or NULL if it could not be started.
+ */
+FileWatch *filewatch_start(const char *path, ptrFileChanged changed,
+							void *arg);
+
+/*
+ * Stops the watch and waits for its thread to finish.
+ * Note: Must not be called from the changed callback.
+ */
+void filewatch_stop(FileWatch *watch);
+
+#endif
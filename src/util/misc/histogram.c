@@ -0,0 +1,100 @@
+#include <string.h>
+
+#include "histogram.h"
+
+#define SUB_BUCKETS		(1 << HISTOGRAM_SUB_BITS)
+
+/*
+ * Returns the bucket a value falls in. Values below SUB_BUCKETS get a bucket
+ * each, after that the leading bit picks the group and the next
+ * HISTOGRAM_SUB_BITS bits pick the bucket within it.
+ */
+static
+unsigned int
+bucket_index(unsigned long long value) {
+	unsigned int bit;
+
+	if (value < SUB_BUCKETS) {
+		return (unsigned int)value;
+	}
+
+	bit = 63 - __builtin_clzll(value);
+	if (bit >= HISTOGRAM_MAX_BITS) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+
+	return ((bit - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) +
+		(unsigned int)((value >> (bit - HISTOGRAM_SUB_BITS)) &
+		(SUB_BUCKETS - 1));
+}
+
+/*
+ * Returns the largest value that falls in the specified bucket.
+ */
+static
+unsigned long long
+bucket_top(unsigned int index) {
+	unsigned int bit;
+	unsigned long long sub;
+
+	if (index < SUB_BUCKETS) {
+		return index;
+	}
+
+	bit = (index >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+	sub = index & (SUB_BUCKETS - 1);
+
+	return ((SUB_BUCKETS + sub + 1) << (bit - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void
+histogram_reset(Histogram *histogram) {
+	memset(histogram, '\0', sizeof(Histogram));
+}
+
+void
+histogram_record(Histogram *histogram, unsigned long long value) {
+	unsigned long long max;
+
+	__atomic_fetch_add(&histogram->counts[bucket_index(value)], 1,
+		__ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+	while (value > max && !__atomic_compare_exchange_n(&histogram->max, &max,
+			value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// max is refreshed by the failed exchange
+	}
+}
+
+unsigned long long
+histogram_percentile(Histogram *histogram, double fraction) {
+	unsigned long long target;
+	unsigned long long seen = 0;
+	unsigned long long count;
+	unsigned int i;
+
+	count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+	if (count == 0) {
+		return 0;
+	}
+
+	target = (unsigned long long)(fraction * count);
+	if (target >= count) {
+		target = count - 1;
+	}
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+		if (seen > target) {
+			// the top bucket is open ended so report the true maximum
+			if (i == HISTOGRAM_BUCKETS - 1 || bucket_top(i) > histogram->max) {
+				return histogram->max;
+			}
+			return bucket_top(i);
+		}
+	}
+
+	return histogram->max;
+}
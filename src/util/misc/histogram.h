@@ -0,0 +1,44 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/*
+ * Log-linear histogram of unsigned values (usually nanoseconds). Each power of
+ * two is split into 2^HISTOGRAM_SUB_BITS linear buckets, which keeps every
+ * bucket within about 12% of the values it holds. Values of
+ * 2^HISTOGRAM_MAX_BITS and above share the last bucket.
+ * Recording is lock-free and may be done from several threads at once.
+ */
+
+#define HISTOGRAM_SUB_BITS		3
+#define HISTOGRAM_MAX_BITS		40
+#define HISTOGRAM_BUCKETS		((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) \
+									<< HISTOGRAM_SUB_BITS)
+
+struct sHistogram {
+	unsigned int counts[HISTOGRAM_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+};
+
+typedef struct sHistogram Histogram;
+
+/*
+ * Clears every bucket of the histogram.
+ */
+void histogram_reset(Histogram *histogram);
+
+/*
+ * Adds a single value to the histogram.
+ */
+void histogram_record(Histogram *histogram, unsigned long long value);
+
+/*
+ * Returns the value below which the specified fraction (0.0 - 1.0) of the
+ * recorded values fall, rounded up to the top of its bucket. Returns 0 if
+ * nothing has been recorded.
+ */
+unsigned long long histogram_percentile(Histogram *histogram,
+										double fraction);
+
+#endif
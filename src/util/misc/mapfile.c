@@ -0,0 +1,187 @@
+#include <string.h>
+
+#include "mapfile.h"
+#include "../log/log.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+/*
+ * Maps the view for a file that has already been opened.
+ * Returns true if the view was mapped.
+ */
+static
+unsigned int
+map_view(MapFile *map) {
+	map->mapping = CreateFileMappingA(map->file, NULL,
+		map->writable ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)(map->size >> 32), (DWORD)map->size, NULL);
+	if (map->mapping == NULL) {
+		return 0;
+	}
+
+	map->data = MapViewOfFile(map->mapping,
+		map->writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+	if (map->data == NULL) {
+		CloseHandle(map->mapping);
+		return 0;
+	}
+
+	return 1;
+}
+
+unsigned int
+mapfile_create(MapFile *map, const char *path, unsigned long long size) {
+	memset(map, '\0', sizeof(MapFile));
+	map->size = size;
+	map->writable = 1;
+
+	map->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (map->file == INVALID_HANDLE_VALUE) {
+		LOG_ERROR("Could not create mapped file (%s).", path);
+		return 0;
+	}
+
+	// mapping a view larger than the file grows the file to match
+	if (!map_view(map)) {
+		LOG_ERROR("Could not map file (%s).", path);
+		CloseHandle(map->file);
+		return 0;
+	}
+
+	return 1;
+}
+
+unsigned int
+mapfile_open(MapFile *map, const char *path) {
+	LARGE_INTEGER size;
+
+	memset(map, '\0', sizeof(MapFile));
+
+	map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ |
+		FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (map->file == INVALID_HANDLE_VALUE) {
+		LOG_ERROR("Could not open mapped file (%s).", path);
+		return 0;
+	}
+
+	if (!GetFileSizeEx(map->file, &size) || size.QuadPart == 0) {
+		LOG_ERROR("Could not map file (%s). File is empty.", path);
+		CloseHandle(map->file);
+		return 0;
+	}
+	map->size = (unsigned long long)size.QuadPart;
+
+	if (!map_view(map)) {
+		LOG_ERROR("Could not map file (%s).", path);
+		CloseHandle(map->file);
+		return 0;
+	}
+
+	return 1;
+}
+
+void
+mapfile_close(MapFile *map, unsigned long long length) {
+	LARGE_INTEGER end;
+
+	if (map->data == NULL) {
+		return;
+	}
+
+	UnmapViewOfFile(map->data);
+	CloseHandle(map->mapping);
+
+	if (map->writable && length < map->size) {
+		end.QuadPart = (LONGLONG)length;
+		SetFilePointerEx(map->file, end, NULL, FILE_BEGIN);
+		SetEndOfFile(map->file);
+	}
+
+	CloseHandle(map->file);
+	memset(map, '\0', sizeof(MapFile));
+}
+#else
+unsigned int
+mapfile_create(MapFile *map, const char *path, unsigned long long size) {
+	memset(map, '\0', sizeof(MapFile));
+	map->size = size;
+	map->writable = 1;
+
+	map->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (map->fd < 0) {
+		LOG_ERROR("Could not create mapped file (%s).", path);
+		return 0;
+	}
+
+	if (ftruncate(map->fd, (off_t)size) != 0) {
+		LOG_ERROR("Could not size mapped file (%s).", path);
+		close(map->fd);
+		return 0;
+	}
+
+	map->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd,
+		0);
+	if (map->data == MAP_FAILED) {
+		LOG_ERROR("Could not map file (%s).", path);
+		map->data = NULL;
+		close(map->fd);
+		return 0;
+	}
+
+	return 1;
+}
+
+unsigned int
+mapfile_open(MapFile *map, const char *path) {
+	struct stat info;
+
+	memset(map, '\0', sizeof(MapFile));
+
+	map->fd = open(path, O_RDONLY);
+	if (map->fd < 0) {
+		LOG_ERROR("Could not open mapped file (%s).", path);
+		return 0;
+	}
+
+	if (fstat(map->fd, &info) != 0 || info.st_size == 0) {
+		LOG_ERROR("Could not map file (%s). File is empty.", path);
+		close(map->fd);
+		return 0;
+	}
+	map->size = (unsigned long long)info.st_size;
+
+	map->data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, map->fd, 0);
+	if (map->data == MAP_FAILED) {
+		LOG_ERROR("Could not map file (%s).", path);
+		map->data = NULL;
+		close(map->fd);
+		return 0;
+	}
+
+	return 1;
+}
+
+void
+mapfile_close(MapFile *map, unsigned long long length) {
+	if (map->data == NULL) {
+		return;
+	}
+
+	munmap(map->data, map->size);
+
+	if (map->writable && length < map->size &&
+			ftruncate(map->fd, (off_t)length) != 0) {
+		LOG_WARN("Could not trim mapped file.");
+	}
+
+	close(map->fd);
+	memset(map, '\0', sizeof(MapFile));
+}
+#endif
@@ -0,0 +1,48 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+/*
+ * Memory-mapped files. Wraps CreateFileMapping/MapViewOfFile on Windows and
+ * mmap everywhere else.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+struct sMapFile {
+	void *data;
+	unsigned long long size;
+	unsigned char writable;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+};
+
+typedef struct sMapFile MapFile;
+
+/*
+ * Creates (or truncates) the file at path, sizes it to size bytes and maps it
+ * for reading and writing. The new bytes read as zero.
+ * Returns true if the file was mapped.
+ */
+unsigned int mapfile_create(MapFile *map, const char *path,
+							unsigned long long size);
+
+/*
+ * Maps the whole of an existing file read-only.
+ * Returns true if the file was mapped. An empty file can't be mapped.
+ */
+unsigned int mapfile_open(MapFile *map, const char *path);
+
+/*
+ * Unmaps the file and closes it. A writable file is cut down to its first
+ * length bytes so that space reserved by mapfile_create() but never used
+ * doesn't stay on disk.
+ */
+void mapfile_close(MapFile *map, unsigned long long length);
+
+#endif
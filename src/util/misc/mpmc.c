@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpmc.h"
+#include "timeutils.h"
+#include "../log/log.h"
+
+/*
+ * A cell is free for the producer holding turn pos when its sequence equals
+ * pos, and holds an item for the consumer holding turn pos when it equals
+ * pos + 1. Taking the item hands the cell on to the producer of the next lap.
+ * Returns 1 if the item was added or 0 if the queue is full.
+ */
+static
+unsigned int
+enqueue(Mpmc *queue, void *item) {
+	MpmcCell *cell;
+	unsigned int pos;
+	int diff;
+
+	pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &queue->cells[pos & queue->mask];
+		diff = (int)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+
+		if (diff == 0) {
+			// a failed exchange reloads pos with the current tail
+			if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->item = item;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Returns 1 if an item was taken from the front of the queue or 0 if it is
+ * empty.
+ */
+static
+unsigned int
+dequeue(Mpmc *queue, void **item) {
+	MpmcCell *cell;
+	unsigned int pos;
+	int diff;
+
+	pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &queue->cells[pos & queue->mask];
+		diff = (int)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) -
+			(pos + 1));
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	*item = cell->item;
+	__atomic_store_n(&cell->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Wakes one thread parked on cond. The fence pairs with the one in the
+ * waiters' loops: either the waiter sees the change that was just made or we
+ * see the waiter and take the lock, which it holds until it is parked.
+ */
+static
+void
+wake(Mpmc *queue, unsigned int *waiters, Cond *cond) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiters, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	mutex_lock(&queue->lock);
+	cond_signal(cond);
+	mutex_unlock(&queue->lock);
+}
+
+/*
+ * Parks until the item can be added, the queue is closed or (if timed)
+ * timeout_ms milliseconds pass.
+ * Returns 1 if the item was added.
+ */
+static
+unsigned int
+push_wait(Mpmc *queue, void *item, unsigned char timed,
+			unsigned int timeout_ms) {
+	unsigned long long start;
+	unsigned long long elapsed_ms;
+	unsigned int added = 0;
+
+	start = time_now_ns();
+
+	mutex_lock(&queue->lock);
+	__atomic_fetch_add(&queue->push_waiters, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&queue->closed, __ATOMIC_RELAXED)) {
+			break;
+		}
+		if (enqueue(queue, item)) {
+			added = 1;
+			break;
+		}
+
+		if (!timed) {
+			cond_wait(&queue->not_full, &queue->lock);
+			continue;
+		}
+
+		elapsed_ms = (time_now_ns() - start) / 1000000;
+		if (elapsed_ms >= timeout_ms) {
+			__atomic_fetch_add(&queue->stats.timeouts, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		cond_timedwait(&queue->not_full, &queue->lock,
+			timeout_ms - (unsigned int)elapsed_ms);
+	}
+	__atomic_fetch_sub(&queue->push_waiters, 1, __ATOMIC_SEQ_CST);
+	mutex_unlock(&queue->lock);
+
+	__atomic_fetch_add(&queue->stats.push_waits, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&queue->stats.push_wait_ns, time_now_ns() - start,
+		__ATOMIC_RELAXED);
+
+	if (added) {
+		wake(queue, &queue->pop_waiters, &queue->not_empty);
+	}
+	return added;
+}
+
+/*
+ * Parks until an item can be taken, the queue is closed and empty or (if
+ * timed) timeout_ms milliseconds pass.
+ * Returns 1 if an item was taken.
+ */
+static
+unsigned int
+pop_wait(Mpmc *queue, void **item, unsigned char timed,
+			unsigned int timeout_ms) {
+	unsigned long long start;
+	unsigned long long elapsed_ms;
+	unsigned int taken = 0;
+
+	start = time_now_ns();
+
+	mutex_lock(&queue->lock);
+	__atomic_fetch_add(&queue->pop_waiters, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (dequeue(queue, item)) {
+			taken = 1;
+			break;
+		}
+		if (__atomic_load_n(&queue->closed, __ATOMIC_RELAXED)) {
+			break;
+		}
+
+		if (!timed) {
+			cond_wait(&queue->not_empty, &queue->lock);
+			continue;
+		}
+
+		elapsed_ms = (time_now_ns() - start) / 1000000;
+		if (elapsed_ms >= timeout_ms) {
+			__atomic_fetch_add(&queue->stats.timeouts, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		cond_timedwait(&queue->not_empty, &queue->lock,
+			timeout_ms - (unsigned int)elapsed_ms);
+	}
+	__atomic_fetch_sub(&queue->pop_waiters, 1, __ATOMIC_SEQ_CST);
+	mutex_unlock(&queue->lock);
+
+	__atomic_fetch_add(&queue->stats.pop_waits, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&queue->stats.pop_wait_ns, time_now_ns() - start,
+		__ATOMIC_RELAXED);
+
+	if (taken) {
+		wake(queue, &queue->push_waiters, &queue->not_full);
+	}
+	return taken;
+}
+
+Mpmc *
+mpmc_create(unsigned int capacity, unsigned char policy,
+			ptrMpmcDropped dropped) {
+	Mpmc *queue;
+	unsigned int size;
+	unsigned int i;
+
+	if (policy != MPMC_BLOCK && policy != MPMC_FAIL &&
+			policy != MPMC_DROP_OLDEST) {
+		LOG_ERROR("Could not create queue. Unknown policy %d.", policy);
+		return NULL;
+	}
+
+	if (capacity > 0x80000000u) {
+		LOG_ERROR("Could not create queue. Capacity %u is too large.",
+			capacity);
+		return NULL;
+	}
+
+	size = 2;
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	queue = malloc(sizeof(Mpmc));
+	if (queue == NULL) {
+		LOG_ERROR("Could not create queue. Insufficient memory.");
+		return NULL;
+	}
+	memset(queue, '\0', sizeof(Mpmc));
+
+	queue->cells = malloc(sizeof(MpmcCell) * size);
+	if (queue->cells == NULL) {
+		LOG_ERROR("Could not create queue. Insufficient memory.");
+		free(queue);
+		return NULL;
+	}
+
+	// every cell starts out free for the producer of the first lap
+	for (i = 0; i < size; i++) {
+		queue->cells[i].sequence = i;
+		queue->cells[i].item = NULL;
+	}
+
+	queue->mask = size - 1;
+	queue->policy = policy;
+	queue->dropped = dropped;
+
+	mutex_init(&queue->lock);
+	cond_init(&queue->not_empty);
+	cond_init(&queue->not_full);
+
+	return queue;
+}
+
+unsigned int
+mpmc_push(Mpmc *queue, void *item) {
+	void *oldest;
+
+	if (__atomic_load_n(&queue->closed, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	if (!enqueue(queue, item)) {
+		switch (queue->policy) {
+			case MPMC_FAIL:
+				__atomic_fetch_add(&queue->stats.rejected, 1,
+					__ATOMIC_RELAXED);
+				return 0;
+
+			case MPMC_DROP_OLDEST:
+				// another producer may take the freed cell so keep going
+				// until ours goes in
+				do {
+					if (dequeue(queue, &oldest)) {
+						__atomic_fetch_add(&queue->stats.dropped, 1,
+							__ATOMIC_RELAXED);
+						if (queue->dropped != NULL) {
+							queue->dropped(oldest);
+						}
+					}
+				} while (!enqueue(queue, item));
+				break;
+
+			default:
+				return push_wait(queue, item, 0, 0);
+		}
+	}
+
+	wake(queue, &queue->pop_waiters, &queue->not_empty);
+	return 1;
+}
+
+unsigned int
+mpmc_try_push(Mpmc *queue, void *item) {
+	if (__atomic_load_n(&queue->closed, __ATOMIC_RELAXED) ||
+			!enqueue(queue, item)) {
+		return 0;
+	}
+
+	wake(queue, &queue->pop_waiters, &queue->not_empty);
+	return 1;
+}
+
+unsigned int
+mpmc_push_timed(Mpmc *queue, void *item, unsigned int timeout_ms) {
+	if (mpmc_try_push(queue, item)) {
+		return 1;
+	}
+
+	if (timeout_ms == 0 || __atomic_load_n(&queue->closed, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	return push_wait(queue, item, 1, timeout_ms);
+}
+
+unsigned int
+mpmc_pop(Mpmc *queue, void **item) {
+	if (mpmc_try_pop(queue, item)) {
+		return 1;
+	}
+
+	return pop_wait(queue, item, 0, 0);
+}
+
+unsigned int
+mpmc_try_pop(Mpmc *queue, void **item) {
+	if (!dequeue(queue, item)) {
+		return 0;
+	}
+
+	wake(queue, &queue->push_waiters, &queue->not_full);
+	return 1;
+}
+
+unsigned int
+mpmc_pop_timed(Mpmc *queue, void **item, unsigned int timeout_ms) {
+	if (mpmc_try_pop(queue, item)) {
+		return 1;
+	}
+
+	if (timeout_ms == 0) {
+		return 0;
+	}
+
+	return pop_wait(queue, item, 1, timeout_ms);
+}
+
+void
+mpmc_close(Mpmc *queue) {
+	__atomic_store_n(&queue->closed, 1, __ATOMIC_SEQ_CST);
+
+	mutex_lock(&queue->lock);
+	cond_broadcast(&queue->not_empty);
+	cond_broadcast(&queue->not_full);
+	mutex_unlock(&queue->lock);
+}
+
+void
+mpmc_get_stats(Mpmc *queue, MpmcStats *stats) {
+	unsigned int head;
+	unsigned int tail;
+
+	// the counters are read separately so the depth is only a snapshot
+	head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+	tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+	stats->depth = (int)(tail - head) > 0 ? tail - head : 0;
+	if (stats->depth > queue->mask + 1) {
+		stats->depth = queue->mask + 1;
+	}
+	stats->capacity = queue->mask + 1;
+	stats->push_waits = __atomic_load_n(&queue->stats.push_waits,
+		__ATOMIC_RELAXED);
+	stats->pop_waits = __atomic_load_n(&queue->stats.pop_waits,
+		__ATOMIC_RELAXED);
+	stats->push_wait_ns = __atomic_load_n(&queue->stats.push_wait_ns,
+		__ATOMIC_RELAXED);
+	stats->pop_wait_ns = __atomic_load_n(&queue->stats.pop_wait_ns,
+		__ATOMIC_RELAXED);
+	stats->rejected = __atomic_load_n(&queue->stats.rejected,
+		__ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&queue->stats.dropped, __ATOMIC_RELAXED);
+	stats->timeouts = __atomic_load_n(&queue->stats.timeouts,
+		__ATOMIC_RELAXED);
+}
+
+void
+mpmc_free(Mpmc *queue) {
+	if (queue == NULL) {
+		LOG_ERROR("Could not free queue resources. Queue has not been " \
+			"initialised.");
+		return;
+	}
+
+	cond_destroy(&queue->not_full);
+	cond_destroy(&queue->not_empty);
+	mutex_destroy(&queue->lock);
+	free(queue->cells);
+	free(queue);
+}
@@ -0,0 +1,152 @@
+#ifndef MPMC_H
+#define MPMC_H
+
+#include "thread.h"
+
+/*
+ * Bounded multi-producer/multi-consumer queue of item pointers. Items live in
+ * a ring of cells, each tagged with a sequence number that tells producers and
+ * consumers whether the cell is free for their turn. Claiming a turn is a
+ * single compare-and-swap on the head or tail counter, so there is no lock on
+ * the push/pop path. Threads that have to wait park on a condition variable,
+ * which is only touched when someone is waiting.
+ */
+
+/*
+ * Backpressure policies used by mpmc_push() when the queue is full.
+ */
+#define MPMC_BLOCK			1	// wait for a consumer to make room
+#define MPMC_FAIL			2	// return straight away without adding the item
+#define MPMC_DROP_OLDEST	3	// discard the item at the front to make room
+
+#define MPMC_CACHE_LINE		64
+
+/*
+ * Called with each item discarded by MPMC_DROP_OLDEST so its owner can free
+ * it. It runs on the pushing thread.
+ */
+typedef void (*ptrMpmcDropped)(void *item);
+
+struct sMpmcCell {
+	unsigned int sequence;
+	void *item;
+};
+
+typedef struct sMpmcCell MpmcCell;
+
+struct sMpmcStats {
+	unsigned int depth;					// items currently queued
+	unsigned int capacity;
+	unsigned long long push_waits;		// pushes that had to park
+	unsigned long long pop_waits;		// pops that had to park
+	unsigned long long push_wait_ns;	// time spent parked by pushes
+	unsigned long long pop_wait_ns;		// time spent parked by pops
+	unsigned long long rejected;		// pushes refused under MPMC_FAIL
+	unsigned long long dropped;			// items discarded by MPMC_DROP_OLDEST
+	unsigned long long timeouts;		// timed calls that gave up
+};
+
+typedef struct sMpmcStats MpmcStats;
+
+/*
+ * The producer and consumer counters sit on their own cache lines so that
+ * the two sides don't keep stealing the line from each other.
+ */
+struct sMpmc {
+	MpmcCell *cells;
+	unsigned int mask;
+	unsigned char policy;
+	ptrMpmcDropped dropped;
+	unsigned int closed;
+	char pad0[MPMC_CACHE_LINE];
+
+	unsigned int tail;					// next turn for a producer
+	char pad1[MPMC_CACHE_LINE - sizeof(unsigned int)];
+
+	unsigned int head;					// next turn for a consumer
+	char pad2[MPMC_CACHE_LINE - sizeof(unsigned int)];
+
+	// parking, only used once a thread has to wait
+	Mutex lock;
+	Cond not_empty;
+	Cond not_full;
+	unsigned int push_waiters;
+	unsigned int pop_waiters;
+
+	MpmcStats stats;
+};
+
+typedef struct sMpmc Mpmc;
+
+/*
+ * Allocates a new empty queue.
+ * capacity is rounded up to a power of two (at least 2).
+ * policy takes a single MPMC_x value and decides what mpmc_push() does when
+ * 		the queue is full.
+ * dropped is optional and is called with items discarded by MPMC_DROP_OLDEST.
+ * Returns NULL if there is insufficient memory.
+ * Note: mpmc_free() must be called once the queue is no longer required.
+ */
+Mpmc *mpmc_create(unsigned int capacity, unsigned char policy,
+					ptrMpmcDropped dropped);
+
+/*
+ * Adds an item to the back of the queue, applying the queue's policy if it is
+ * full.
+ * Returns 1 if the item was added, or 0 if it was refused or the queue has
+ * been closed.
+ */
+unsigned int mpmc_push(Mpmc *queue, void *item);
+
+/*
+ * Adds an item to the back of the queue if there is room, regardless of
+ * policy.
+ * Returns 1 if the item was added.
+ */
+unsigned int mpmc_try_push(Mpmc *queue, void *item);
+
+/*
+ * Same as mpmc_push() under MPMC_BLOCK, but gives up after timeout_ms
+ * milliseconds.
+ * Returns 1 if the item was added.
+ */
+unsigned int mpmc_push_timed(Mpmc *queue, void *item, unsigned int timeout_ms);
+
+/*
+ * Removes the item at the front of the queue, waiting for one if the queue is
+ * empty.
+ * item receives the item.
+ * Returns 1 if an item was removed, or 0 if the queue was closed and is empty.
+ */
+unsigned int mpmc_pop(Mpmc *queue, void **item);
+
+/*
+ * Removes the item at the front of the queue if there is one.
+ * Returns 1 if an item was removed.
+ */
+unsigned int mpmc_try_pop(Mpmc *queue, void **item);
+
+/*
+ * Same as mpmc_pop() but gives up after timeout_ms milliseconds.
+ * Returns 1 if an item was removed.
+ */
+unsigned int mpmc_pop_timed(Mpmc *queue, void **item, unsigned int timeout_ms);
+
+/*
+ * Stops the queue accepting new items and wakes every waiting thread. Items
+ * already queued can still be popped.
+ */
+void mpmc_close(Mpmc *queue);
+
+/*
+ * Copies the current depth and counters into stats.
+ */
+void mpmc_get_stats(Mpmc *queue, MpmcStats *stats);
+
+/*
+ * Frees all resources occupied by the queue.
+ * Note: Items still queued are not freed. No thread may be using the queue.
+ */
+void mpmc_free(Mpmc *queue);
+
+#endif
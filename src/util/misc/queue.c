@@ -5,63 +5,366 @@
 #include "queue.h"
 #include "../log/log.h"
 
+#define QUEUE_MIN_MAP		8
+
+/*
+ * Returns the address of the slot holding the item at the specified position
+ * of a chunked queue. The position may be one past the last item.
+ */
+static
+void **
+chunk_slot(Queue *queue, unsigned int position) {
+	unsigned int offset = queue->first_offset + position;
+	unsigned int chunk;
+
+	chunk = (queue->map_first + offset / QUEUE_CHUNK_ITEMS) &
+		(queue->map_size - 1);
+	return &queue->chunks[chunk][offset % QUEUE_CHUNK_ITEMS];
+}
+
+/*
+ * Makes sure the chunk map has room for the specified number of blocks. The
+ * blocks are copied to the start of a larger map when it has to grow.
+ * Returns 1 if there is room.
+ */
+static
+unsigned int
+reserve_chunks(Queue *queue, unsigned int count) {
+	void ***chunks;
+	unsigned int size;
+	unsigned int i;
+
+	if (count <= queue->map_size) {
+		return 1;
+	}
+
+	size = queue->map_size > 0 ? queue->map_size : QUEUE_MIN_MAP;
+	while (size < count) {
+		size *= 2;
+	}
+
+	chunks = malloc(sizeof(void **) * size);
+	if (chunks == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < queue->num_chunks; i++) {
+		chunks[i] = queue->chunks[(queue->map_first + i) &
+			(queue->map_size - 1)];
+	}
+
+	free(queue->chunks);
+	queue->chunks = chunks;
+	queue->map_size = size;
+	queue->map_first = 0;
+	return 1;
+}
+
+/*
+ * Adds an empty block to the front or back of a chunked queue.
+ * Returns 1 if the block was added.
+ */
+static
+unsigned int
+add_chunk(Queue *queue, unsigned char front) {
+	void **chunk;
+	unsigned int slot;
+
+	if (!reserve_chunks(queue, queue->num_chunks + 1)) {
+		return 0;
+	}
+
+	chunk = malloc(sizeof(void *) * QUEUE_CHUNK_ITEMS);
+	if (chunk == NULL) {
+		return 0;
+	}
+
+	if (front) {
+		queue->map_first = (queue->map_first - 1) & (queue->map_size - 1);
+		slot = queue->map_first;
+	} else {
+		slot = (queue->map_first + queue->num_chunks) & (queue->map_size - 1);
+	}
+
+	queue->chunks[slot] = chunk;
+	queue->num_chunks++;
+	return 1;
+}
+
 /*
- * Returns the Queue struct for the last item in the queue.
- * before - points to the Queue struct directly before the last or NULL if
- *			the last item is also the first.
+ * Frees the first or last block of a chunked queue.
  */
+static
+void
+drop_chunk(Queue *queue, unsigned char front) {
+	unsigned int slot;
+
+	if (front) {
+		slot = queue->map_first;
+		queue->map_first = (queue->map_first + 1) & (queue->map_size - 1);
+	} else {
+		slot = (queue->map_first + queue->num_chunks - 1) &
+			(queue->map_size - 1);
+	}
+
+	free(queue->chunks[slot]);
+	queue->num_chunks--;
+}
+
+/*
+ * Returns a node from the queue's pool, or from malloc if it has none. NULL is
+ * returned if there is insufficient memory.
+ */
+static
+QueueNode *
+acquire_node(Queue *queue) {
+	QueueNodePool *pool = queue->pool;
+	QueueNodeSlab *slab;
+	QueueNode *node;
+	unsigned int i;
+
+	if (pool == NULL) {
+		return malloc(sizeof(QueueNode));
+	}
+
+	// carve a new slab into the free list once it runs dry
+	if (pool->free_nodes == NULL) {
+		slab = malloc(sizeof(QueueNodeSlab));
+		if (slab == NULL) {
+			return NULL;
+		}
+
+		for (i = QUEUE_SLAB_NODES; i > 0; i--) {
+			slab->nodes[i - 1].next = pool->free_nodes;
+			pool->free_nodes = &slab->nodes[i - 1];
+		}
+
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		pool->stats.slabs++;
+		pool->stats.free += QUEUE_SLAB_NODES;
+	}
+
+	node = pool->free_nodes;
+	pool->free_nodes = node->next;
+
+	pool->stats.free--;
+	pool->stats.acquired++;
+	if (++pool->stats.in_use > pool->stats.high_water) {
+		pool->stats.high_water = pool->stats.in_use;
+	}
+
+	return node;
+}
+
+/*
+ * Hands a node back to wherever acquire_node() found it.
+ */
+static
+void
+release_node(Queue *queue, QueueNode *node) {
+	QueueNodePool *pool = queue->pool;
+
+	if (pool == NULL) {
+		free(node);
+		return;
+	}
+
+	node->next = pool->free_nodes;
+	pool->free_nodes = node;
+	pool->stats.in_use--;
+	pool->stats.free++;
+}
+
 static
 Queue *
-get_last(Queue *queue, Queue *before) {
-	Queue *curr;
-	
+create_queue(unsigned char type) {
+	Queue *queue;
+
+	queue = malloc(sizeof(Queue));
 	if (queue == NULL) {
+		LOG_ERROR("Could not create queue. Insufficient memory.");
 		return NULL;
 	}
-	
-	curr = queue;
-	while (curr->next != NULL) {
-		before = curr;
-		curr = curr->next;
+	memset(queue, '\0', sizeof(Queue));
+	queue->type = type;
+
+	return queue;
+}
+
+Queue *
+queue_create() {
+	return create_queue(QUEUE_LINKED);
+}
+
+Queue *
+queue_create_chunked() {
+	return create_queue(QUEUE_CHUNKED);
+}
+
+Queue *
+queue_create_pooled(QueueNodePool *pool) {
+	Queue *queue;
+
+	queue = create_queue(QUEUE_LINKED);
+	if (queue == NULL) {
+		return NULL;
 	}
-	
-	return curr;
+
+	if (pool == NULL) {
+		pool = queue_pool_create();
+		if (pool == NULL) {
+			free(queue);
+			return NULL;
+		}
+		queue->owns_pool = 1;
+	}
+
+	queue->pool = pool;
+	pool->stats.queues++;
+
+	return queue;
+}
+
+QueueNodePool *
+queue_pool_create() {
+	QueueNodePool *pool;
+
+	pool = malloc(sizeof(QueueNodePool));
+	if (pool == NULL) {
+		LOG_ERROR("Could not create node pool. Insufficient memory.");
+		return NULL;
+	}
+	memset(pool, '\0', sizeof(QueueNodePool));
+	pool->stats.slab_nodes = QUEUE_SLAB_NODES;
+
+	return pool;
+}
+
+void
+queue_pool_get_stats(QueueNodePool *pool, QueueNodePoolStats *stats) {
+	*stats = pool->stats;
 }
 
-unsigned int 
+void
+queue_pool_free(QueueNodePool *pool) {
+	QueueNodeSlab *slab;
+
+	if (pool == NULL) {
+		LOG_ERROR("Could not free node pool. Pool has not been " \
+			"initialised.");
+		return;
+	}
+
+	if (pool->stats.queues > 0) {
+		LOG_ERROR("Could not free node pool. It is still used by %u queues.",
+			pool->stats.queues);
+		return;
+	}
+
+	while ((slab = pool->slabs) != NULL) {
+		pool->slabs = slab->next;
+		free(slab);
+	}
+
+	free(pool);
+}
+
+int 
 queue_push(Queue *queue, void *item) {
-	Queue *last;
-	Queue *new;
-	
-	// find the end of the queue and add the item there
-	last = get_last(queue);
-	
-	new = malloc(sizeof(Queue));
+	QueueNode *new;
+
+	if (queue == NULL) {
+		LOG_ERROR("Could not add item to queue. Queue has not been " \
+			"initiliased");
+		return -1;
+	}
+
+	if (queue->type == QUEUE_CHUNKED) {
+		// the last block is full (or there is none) so start another
+		if (queue->first_offset + queue->length ==
+				queue->num_chunks * QUEUE_CHUNK_ITEMS &&
+				!add_chunk(queue, 0)) {
+			LOG_ERROR("Could not add item to queue. Insufficient memory.");
+			return -1;
+		}
+
+		*chunk_slot(queue, queue->length) = item;
+		return queue->length++;
+	}
+
+	new = acquire_node(queue);
 	if (new == NULL) {
 		LOG_ERROR("Could not add item to queue. Insufficient memory.");
 		return -1;
 	}
-	memset(new, '\0', sizeof(Queue));
-	
+
 	new->item = item;
-	
-	// determine whether the new item falls at the first position
-	// also sets the index (zero based)
-	if (last == NULL) {
-		new->index = 0;
-		queue = new;
+	new->prev = queue->tail;
+	new->next = NULL;
+
+	// the new item goes after the current tail
+	if (queue->tail == NULL) {
+		queue->head = new;
 	} else {
-		new->index = ++last->index;
-		last->next = new;
+		queue->tail->next = new;
 	}
-		
-	return new->index;
+	queue->tail = new;
+
+	return queue->length++;
+}
+
+int
+queue_push_front(Queue *queue, void *item) {
+	QueueNode *new;
+
+	if (queue == NULL) {
+		LOG_ERROR("Could not add item to queue. Queue has not been " \
+			"initiliased");
+		return -1;
+	}
+
+	if (queue->type == QUEUE_CHUNKED) {
+		// no room before the first item so open a block in front of it
+		if (queue->first_offset == 0) {
+			if (!add_chunk(queue, 1)) {
+				LOG_ERROR("Could not add item to queue. Insufficient " \
+					"memory.");
+				return -1;
+			}
+			queue->first_offset = QUEUE_CHUNK_ITEMS;
+		}
+
+		queue->first_offset--;
+		queue->length++;
+		*chunk_slot(queue, 0) = item;
+		return 0;
+	}
+
+	new = acquire_node(queue);
+	if (new == NULL) {
+		LOG_ERROR("Could not add item to queue. Insufficient memory.");
+		return -1;
+	}
+
+	new->item = item;
+	new->prev = NULL;
+	new->next = queue->head;
+
+	if (queue->head == NULL) {
+		queue->tail = new;
+	} else {
+		queue->head->prev = new;
+	}
+	queue->head = new;
+	queue->length++;
+
+	return 0;
 }
 
 void * 
 queue_pop(Queue *queue) {
-	Queue *last;
-	Queue *before;
+	QueueNode *first;
 	void *item;
 
 	if (queue == NULL) {
@@ -69,49 +372,138 @@ queue_pop(Queue *queue) {
 			"initiliased");
 		return NULL;
 	}
-	
-	// get last item in the queue and keep the item data
-	last = get_last(queue, before);
+
+	if (queue->length == 0) {
+		return NULL;
+	}
+
+	if (queue->type == QUEUE_CHUNKED) {
+		item = *chunk_slot(queue, 0);
+		queue->length--;
+
+		// release the first block once the last item in it is taken
+		if (++queue->first_offset == QUEUE_CHUNK_ITEMS) {
+			drop_chunk(queue, 1);
+			queue->first_offset = 0;
+		}
+		return item;
+	}
+
+	// unlink the first item in the queue and keep the item data
+	first = queue->head;
+	item = first->item;
+
+	queue->head = first->next;
+	if (queue->head == NULL) {
+		queue->tail = NULL;
+	} else {
+		queue->head->prev = NULL;
+	}
+	queue->length--;
+
+	release_node(queue, first);
+
+	return item;
+}
+
+void *
+queue_pop_back(Queue *queue) {
+	QueueNode *last;
+	void *item;
+
+	if (queue == NULL) {
+		LOG_ERROR("Could not pop item from queue. Queue has not been " \
+			"initiliased");
+		return NULL;
+	}
+
+	if (queue->length == 0) {
+		return NULL;
+	}
+
+	if (queue->type == QUEUE_CHUNKED) {
+		queue->length--;
+		item = *chunk_slot(queue, queue->length);
+
+		// release the last block once it is empty, keeping one block around
+		// so a queue that see-saws around empty doesn't thrash malloc
+		if ((queue->first_offset + queue->length) % QUEUE_CHUNK_ITEMS == 0 &&
+				queue->num_chunks > 1) {
+			drop_chunk(queue, 0);
+		}
+		return item;
+	}
+
+	last = queue->tail;
 	item = last->item;
-	
-	if (before != NULL) {
-		// remove references to the last item in the queue
-		before->next = NULL;
+
+	queue->tail = last->prev;
+	if (queue->tail == NULL) {
+		queue->head = NULL;
+	} else {
+		queue->tail->next = NULL;
 	}
-	free(last);
-	
+	queue->length--;
+
+	release_node(queue, last);
+
 	return item;
 }
 
 void *
 queue_get_by_index(Queue *queue, unsigned int index) {
-	Queue *curr;
+	QueueNode *curr;
 	
 	if (queue == NULL) {
 		LOG_ERROR("Could not get item in queue. Queue has not been " \
 			"initiliased.");
 		return NULL;
 	}
-	
-	if (queue->index == index) {
-		return queue->item;
+
+	if (index >= queue->length) {
+		return NULL;
 	}
-	
-	curr = queue;
-	while (curr->next != NULL) {
-		if (curr->index == index) {
-			return curr->item;
+
+	if (queue->type == QUEUE_CHUNKED) {
+		return *chunk_slot(queue, index);
+	}
+
+	// the last item is a common request so skip the walk
+	if (index == queue->length - 1) {
+		return queue->tail->item;
+	}
+
+	// walk from whichever end is closer
+	if (index > queue->length / 2) {
+		curr = queue->tail;
+		index = queue->length - 1 - index;
+		while (index-- > 0) {
+			curr = curr->prev;
 		}
+		return curr->item;
+	}
+
+	curr = queue->head;
+	while (index-- > 0) {
 		curr = curr->next;
 	}
 	
-	return NULL;
+	return curr->item;
+}
+
+unsigned int
+queue_size(Queue *queue) {
+	if (queue == NULL) {
+		return 0;
+	}
+
+	return queue->length;
 }
 
 void 
 queue_free(Queue *queue) {
-	Queue *curr;
-	Queue *prev;
+	QueueNode *curr;
+	QueueNode *next;
 	
 	if (queue == NULL) {
 		LOG_ERROR("Could not free queue resources. Queue has not been " \
@@ -121,12 +513,30 @@ queue_free(Queue *queue) {
 	
 	// free resources for the entire queue
 	// we are only interested in the queue structures and not the data they hold
-	curr = queue;
-	while (curr->next != NULL) {
-		prev = curr;
-		curr = curr->next;
-		
-		free(prev);
+	if (queue->type == QUEUE_CHUNKED) {
+		while (queue->num_chunks > 0) {
+			drop_chunk(queue, 1);
+		}
+		free(queue->chunks);
+	}
+
+	// a pool of our own goes with the queue, slabs and all
+	if (queue->owns_pool) {
+		queue->pool->stats.queues--;
+		queue_pool_free(queue->pool);
+		free(queue);
+		return;
+	}
+
+	curr = queue->head;
+	while (curr != NULL) {
+		next = curr->next;
+		release_node(queue, curr);
+		curr = next;
+	}
+
+	if (queue->pool != NULL) {
+		queue->pool->stats.queues--;
 	}
 	
 	free(queue);
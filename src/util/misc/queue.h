@@ -1,36 +1,175 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
-struct sQueue {
-	unsigned int index;
+/*
+ * Queue storage types.
+ */
+#define QUEUE_LINKED		1	// doubly linked list of nodes
+#define QUEUE_CHUNKED		2	// deque of fixed size blocks of item pointers
+
+/*
+ * Number of item pointers held by each block of a QUEUE_CHUNKED queue.
+ */
+#define QUEUE_CHUNK_ITEMS	64
+
+struct sQueueNode {
 	void *item;
-	struct sQueue *next;
+	struct sQueueNode *prev;
+	struct sQueueNode *next;
+};
+
+typedef struct sQueueNode QueueNode;
+
+/*
+ * Size of each slab of nodes allocated by a QueueNodePool.
+ */
+#define QUEUE_SLAB_BYTES	4096
+#define QUEUE_SLAB_NODES	((QUEUE_SLAB_BYTES - sizeof(void *)) / \
+								sizeof(QueueNode))
+
+struct sQueueNodeSlab {
+	struct sQueueNodeSlab *next;
+	QueueNode nodes[QUEUE_SLAB_NODES];
+};
+
+typedef struct sQueueNodeSlab QueueNodeSlab;
+
+struct sQueueNodePoolStats {
+	unsigned int slabs;				// slabs currently allocated
+	unsigned int slab_nodes;		// nodes held by each slab
+	unsigned int in_use;			// nodes currently holding items
+	unsigned int free;				// nodes waiting on the free list
+	unsigned int high_water;		// most nodes in use at once
+	unsigned long long acquired;	// nodes handed out since creation
+	unsigned int queues;			// queues currently using the pool
+};
+
+typedef struct sQueueNodePoolStats QueueNodePoolStats;
+
+/*
+ * Linked queue nodes are carved out of page sized slabs and recycled through
+ * a free list so pushing and popping don't go through malloc. A pool may be
+ * shared by several queues, but it is not thread safe: every queue using it
+ * must be used from the same thread (or under the same lock).
+ */
+struct sQueueNodePool {
+	QueueNodeSlab *slabs;
+	QueueNode *free_nodes;
+	QueueNodePoolStats stats;
+};
+
+typedef struct sQueueNodePool QueueNodePool;
+
+/*
+ * Queue handle. Tracking both ends and the length keeps pushing, popping and
+ * sizing the queue O(1).
+ * A QUEUE_CHUNKED queue keeps its items in blocks of QUEUE_CHUNK_ITEMS
+ * pointers. The blocks are listed in a circular map so that blocks can be
+ * added or dropped at either end, and any index is found with a division.
+ */
+struct sQueue {
+	unsigned char type;
+	unsigned int length;
+
+	// QUEUE_LINKED
+	QueueNode *head;
+	QueueNode *tail;
+	QueueNodePool *pool;		// NULL if nodes come from malloc
+	unsigned char owns_pool;
+
+	// QUEUE_CHUNKED
+	void ***chunks;
+	unsigned int map_size;		// slots in the chunk map, a power of two
+	unsigned int map_first;		// map slot of the first block
+	unsigned int num_chunks;
+	unsigned int first_offset;	// position of the first item in its block
 };
 
 typedef struct sQueue Queue;
 
+/*
+ * Allocates a new empty linked queue.
+ * Returns NULL if there is insufficient memory.
+ * Note: queue_free() must be called once the queue is no longer required.
+ */
+Queue *queue_create();
+
+/*
+ * Allocates a new empty chunked queue. It supports the same calls as a
+ * linked queue but queue_get_by_index() is O(1) and items are stored
+ * contiguously.
+ * Returns NULL if there is insufficient memory.
+ */
+Queue *queue_create_chunked();
+
+/*
+ * Allocates a new empty linked queue whose nodes come from a slab pool.
+ * pool is shared with any other queues using it. Passing NULL gives the queue
+ *		a pool of its own, which is released with the queue.
+ * Returns NULL if there is insufficient memory.
+ */
+Queue *queue_create_pooled(QueueNodePool *pool);
+
+/*
+ * Allocates a new node pool which can be shared by several queues.
+ * Returns NULL if there is insufficient memory.
+ * Note: queue_pool_free() must be called once every queue using the pool has
+ *		been freed.
+ */
+QueueNodePool *queue_pool_create();
+
+/*
+ * Copies the pool's slab usage into stats.
+ */
+void queue_pool_get_stats(QueueNodePool *pool, QueueNodePoolStats *stats);
+
+/*
+ * Releases every slab held by the pool. The pool is left in place if any
+ * queue is still using it.
+ */
+void queue_pool_free(QueueNodePool *pool);
+
 /*
  * Push a new item onto the end of the queue.
- * Returns the index of the newly added item.
+ * Returns the index of the newly added item or -1 if it could not be added.
+ */
+int queue_push(Queue *queue, void *item);
+
+/*
+ * Push a new item onto the front of the queue. It becomes index 0.
+ * Returns 0 or -1 if it could not be added.
  */
-unsigned int queue_push(Queue *queue, void *item);
+int queue_push_front(Queue *queue, void *item);
 
 /*
  * Retrieves and removes the first item in the queue.
  * Note: This returns a pointer to the actual item data and not the queue
  * 			structure.
  */
-void *queue_pop(Queue *queue, void *item);
+void *queue_pop(Queue *queue);
+
+/*
+ * Retrieves and removes the last item in the queue.
+ */
+void *queue_pop_back(Queue *queue);
 
 /* 
- * Retrieves an item in the queue based on it's index
+ * Retrieves an item in the queue based on it's index. Index 0 is the first
+ * item in the queue (the next one to be popped).
  * Note: This returns a pointer to the actual item data and not the queue
  * 			structure.
  */
 void *queue_get_by_index(Queue *queue, unsigned int index);
 
 /*
- * Frees all resources occupied by the queue.
+ * Returns the number of items currently in the queue.
+ */
+unsigned int queue_size(Queue *queue);
+
+/*
+ * Frees all resources occupied by the queue. A queue that owns its pool
+ * releases the pool's slabs whole. Nodes drawn from a shared pool go back on
+ * the pool's free list.
  * Note: Freeing the queue resources does NOT free the resources the items 
  * 		themselves consume. They will need to be explicitly recovered. 
  *		The ideal time to do this would probably before queue_free() is called.
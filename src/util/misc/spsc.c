@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+#include "../log/log.h"
+
+/*
+ * Returns the number of free slots the producer can fill, refreshing its copy
+ * of the consumer's index only when the cached copy can't satisfy wanted.
+ */
+static
+unsigned int
+free_slots(Spsc *ring, unsigned int wanted) {
+	unsigned int capacity = ring->mask + 1;
+	unsigned int free;
+
+	free = capacity - (ring->tail - ring->head_cache);
+	if (free < wanted) {
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		free = capacity - (ring->tail - ring->head_cache);
+	}
+
+	return free;
+}
+
+/*
+ * Returns the number of items the consumer can take, refreshing its copy of
+ * the producer's index only when the cached copy can't satisfy wanted.
+ */
+static
+unsigned int
+used_slots(Spsc *ring, unsigned int wanted) {
+	unsigned int used;
+
+	used = ring->tail_cache - ring->head;
+	if (used < wanted) {
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		used = ring->tail_cache - ring->head;
+	}
+
+	return used;
+}
+
+Spsc *
+spsc_create(unsigned int capacity) {
+	Spsc *ring;
+	unsigned int size;
+
+	if (capacity > 0x80000000u) {
+		LOG_ERROR("Could not create ring. Capacity %u is too large.",
+			capacity);
+		return NULL;
+	}
+
+	size = 2;
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	ring = malloc(sizeof(Spsc));
+	if (ring == NULL) {
+		LOG_ERROR("Could not create ring. Insufficient memory.");
+		return NULL;
+	}
+	memset(ring, '\0', sizeof(Spsc));
+
+	ring->ring = malloc(sizeof(void *) * size);
+	if (ring->ring == NULL) {
+		LOG_ERROR("Could not create ring. Insufficient memory.");
+		free(ring);
+		return NULL;
+	}
+	ring->mask = size - 1;
+
+	return ring;
+}
+
+unsigned int
+spsc_push(Spsc *ring, void *item) {
+	if (free_slots(ring, 1) == 0) {
+		return 0;
+	}
+
+	ring->ring[ring->tail & ring->mask] = item;
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+unsigned int
+spsc_push_batch(Spsc *ring, void **items, unsigned int count) {
+	unsigned int free;
+	unsigned int i;
+
+	free = free_slots(ring, count);
+	if (count > free) {
+		count = free;
+	}
+
+	for (i = 0; i < count; i++) {
+		ring->ring[(ring->tail + i) & ring->mask] = items[i];
+	}
+
+	// a single release store hands the whole batch over
+	if (count > 0) {
+		__atomic_store_n(&ring->tail, ring->tail + count, __ATOMIC_RELEASE);
+	}
+	return count;
+}
+
+unsigned int
+spsc_pop(Spsc *ring, void **item) {
+	if (used_slots(ring, 1) == 0) {
+		return 0;
+	}
+
+	*item = ring->ring[ring->head & ring->mask];
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+unsigned int
+spsc_pop_batch(Spsc *ring, void **items, unsigned int max) {
+	unsigned int used;
+	unsigned int i;
+
+	used = used_slots(ring, max);
+	if (max > used) {
+		max = used;
+	}
+
+	for (i = 0; i < max; i++) {
+		items[i] = ring->ring[(ring->head + i) & ring->mask];
+	}
+
+	if (max > 0) {
+		__atomic_store_n(&ring->head, ring->head + max, __ATOMIC_RELEASE);
+	}
+	return max;
+}
+
+unsigned int
+spsc_size(Spsc *ring) {
+	unsigned int head;
+	unsigned int tail;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	return (int)(tail - head) > 0 ? tail - head : 0;
+}
+
+void
+spsc_free(Spsc *ring) {
+	if (ring == NULL) {
+		LOG_ERROR("Could not free ring resources. Ring has not been " \
+			"initialised.");
+		return;
+	}
+
+	free(ring->ring);
+	free(ring);
+}
@@ -0,0 +1,79 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+/*
+ * Bounded single-producer/single-consumer ring of item pointers. Exactly one
+ * thread may push and exactly one thread may pop. Neither side ever waits on
+ * the other: each call finishes in a fixed number of steps and returns 0
+ * if the ring is full or empty.
+ * Each side keeps its own index on its own cache line, together with a cached
+ * copy of the other side's index. The other side's line is only read when
+ * the cached copy says the ring is full (or empty).
+ */
+
+#define SPSC_CACHE_LINE		64
+
+struct sSpsc {
+	void **ring;
+	unsigned int mask;
+	char pad0[SPSC_CACHE_LINE];
+
+	// producer side
+	unsigned int tail;
+	unsigned int head_cache;
+	char pad1[SPSC_CACHE_LINE - 2 * sizeof(unsigned int)];
+
+	// consumer side
+	unsigned int head;
+	unsigned int tail_cache;
+	char pad2[SPSC_CACHE_LINE - 2 * sizeof(unsigned int)];
+};
+
+typedef struct sSpsc Spsc;
+
+/*
+ * Allocates a new empty ring.
+ * capacity is rounded up to a power of two (at least 2).
+ * Returns NULL if there is insufficient memory.
+ * Note: spsc_free() must be called once the ring is no longer required.
+ */
+Spsc *spsc_create(unsigned int capacity);
+
+/*
+ * Adds an item to the back of the ring. Producer only.
+ * Returns 1 if the item was added or 0 if the ring is full.
+ */
+unsigned int spsc_push(Spsc *ring, void *item);
+
+/*
+ * Adds up to count items to the back of the ring and publishes them at once.
+ * Producer only.
+ * Returns the number of items added, taken from the start of items.
+ */
+unsigned int spsc_push_batch(Spsc *ring, void **items, unsigned int count);
+
+/*
+ * Removes the item at the front of the ring. Consumer only.
+ * Returns 1 if an item was removed or 0 if the ring is empty.
+ */
+unsigned int spsc_pop(Spsc *ring, void **item);
+
+/*
+ * Removes up to max items from the front of the ring. Consumer only.
+ * Returns the number of items copied into items.
+ */
+unsigned int spsc_pop_batch(Spsc *ring, void **items, unsigned int max);
+
+/*
+ * Returns the number of items in the ring. From any thread other than the
+ * producer or consumer this is only a snapshot.
+ */
+unsigned int spsc_size(Spsc *ring);
+
+/*
+ * Frees all resources occupied by the ring.
+ * Note: Items still in the ring are not freed.
+ */
+void spsc_free(Spsc *ring);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "thread.h"
+#include "../log/log.h"
+
+#ifndef _WIN32
+#include <sched.h>
+#include <time.h>
+#endif
+
+/*
+ * Carries the caller's entry point across to the native thread start routine.
+ */
+struct sThreadStart {
+	ptrThreadMain thread_main;
+	void *arg;
+};
+
+typedef struct sThreadStart ThreadStart;
+
+#ifdef _WIN32
+static
+DWORD WINAPI
+thread_start(LPVOID param) {
+#else
+static
+void *
+thread_start(void *param) {
+#endif
+	ThreadStart start;
+
+	start = *(ThreadStart *)param;
+	free(param);
+
+	start.thread_main(start.arg);
+
+	return 0;
+}
+
+unsigned int
+thread_create(Thread *thread, ptrThreadMain thread_main, void *arg) {
+	ThreadStart *start;
+
+	start = malloc(sizeof(ThreadStart));
+	if (start == NULL) {
+		LOG_ERROR("Could not create thread. Insufficient memory.");
+		return 0;
+	}
+	start->thread_main = thread_main;
+	start->arg = arg;
+
+#ifdef _WIN32
+	*thread = CreateThread(NULL, 0, thread_start, start, 0, NULL);
+	if (*thread == NULL) {
+#else
+	if (pthread_create(thread, NULL, thread_start, start) != 0) {
+#endif
+		LOG_ERROR("Could not create thread.");
+		free(start);
+		return 0;
+	}
+
+	return 1;
+}
+
+void
+thread_join(Thread *thread) {
+#ifdef _WIN32
+	WaitForSingleObject(*thread, INFINITE);
+	CloseHandle(*thread);
+#else
+	pthread_join(*thread, NULL);
+#endif
+}
+
+void
+thread_yield() {
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+void
+mutex_init(Mutex *mutex) {
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void
+mutex_lock(Mutex *mutex) {
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
+}
+
+void
+mutex_unlock(Mutex *mutex) {
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
+
+void
+mutex_destroy(Mutex *mutex) {
+#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif
+}
+
+void
+cond_init(Cond *cond) {
+#ifdef _WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void
+cond_wait(Cond *cond, Mutex *mutex) {
+#ifdef _WIN32
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+	pthread_cond_wait(cond, mutex);
+#endif
+}
+
+unsigned int
+cond_timedwait(Cond *cond, Mutex *mutex, unsigned int timeout_ms) {
+#ifdef _WIN32
+	return SleepConditionVariableCS(cond, mutex, timeout_ms) ? 1 : 0;
+#else
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	return pthread_cond_timedwait(cond, mutex, &deadline) != ETIMEDOUT;
+#endif
+}
+
+void
+cond_signal(Cond *cond) {
+#ifdef _WIN32
+	WakeConditionVariable(cond);
+#else
+	pthread_cond_signal(cond);
+#endif
+}
+
+void
+cond_broadcast(Cond *cond) {
+#ifdef _WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
+void
+cond_destroy(Cond *cond) {
+#ifdef _WIN32
+	// Win32 condition variables hold no resources
+	(void)cond;
+#else
+	pthread_cond_destroy(cond);
+#endif
+}
@@ -0,0 +1,63 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+/*
+ * Thin wrapper over the native threading primitives so the rest of the code
+ * builds against both Win32 threads and pthreads.
+ */
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600		// condition variables need Vista or later
+#endif
+#include <windows.h>
+
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+#else
+#include <pthread.h>
+
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#endif
+
+typedef void (*ptrThreadMain)(void *arg);
+
+/*
+ * Starts a new thread running thread_main(arg).
+ * Returns true if the thread was started.
+ */
+unsigned int thread_create(Thread *thread, ptrThreadMain thread_main,
+							void *arg);
+
+/*
+ * Blocks until the specified thread has returned.
+ */
+void thread_join(Thread *thread);
+
+/*
+ * Gives up the remainder of the calling thread's time slice.
+ */
+void thread_yield();
+
+void mutex_init(Mutex *mutex);
+void mutex_lock(Mutex *mutex);
+void mutex_unlock(Mutex *mutex);
+void mutex_destroy(Mutex *mutex);
+
+void cond_init(Cond *cond);
+void cond_wait(Cond *cond, Mutex *mutex);
+
+/*
+ * Waits on cond for at most timeout_ms milliseconds.
+ * Returns false if the wait timed out.
+ */
+unsigned int cond_timedwait(Cond *cond, Mutex *mutex, unsigned int timeout_ms);
+
+void cond_signal(Cond *cond);
+void cond_broadcast(Cond *cond);
+void cond_destroy(Cond *cond);
+
+#endif
@@ -0,0 +1,30 @@
+#include "timeutils.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+unsigned long long
+time_now_ns() {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&counter);
+
+	// split the conversion to avoid overflowing on long uptimes
+	return (unsigned long long)(counter.QuadPart / frequency.QuadPart) *
+		1000000000ULL + (unsigned long long)(counter.QuadPart %
+		frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
@@ -0,0 +1,10 @@
+#ifndef TIME_UTILS_H
+#define TIME_UTILS_H
+
+/*
+ * Returns a monotonic timestamp in nanoseconds. Only the difference between
+ * two timestamps is meaningful.
+ */
+unsigned long long time_now_ns();
+
+#endif